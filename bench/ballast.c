@@ -0,0 +1,32 @@
+/*
+ * ballast.c - Make a program big before it starts, to see what its
+ *    size costs
+ *
+ * Preloaded with LD_PRELOAD=./ballast.so and TSH_BALLAST_MB=n set, it
+ * touches n MB of memory before main runs, so every page of it is
+ * resident and mapped, in small pages the way a heap that has grown bit
+ * by bit would be. It takes both variables out of the environment
+ * first, so the programs that process starts don't get ballast too.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+static char *ballast;       /* kept mapped for good */
+
+__attribute__((constructor))
+static void load(void)
+{
+    const char *mb = getenv("TSH_BALLAST_MB");
+    size_t size = mb ? strtoul(mb, NULL, 10) << 20 : 0;
+
+    unsetenv("TSH_BALLAST_MB");
+    unsetenv("LD_PRELOAD");
+    if (!size)
+        return;
+    ballast = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ballast == MAP_FAILED)
+        return;
+    madvise(ballast, size, MADV_NOHUGEPAGE);
+    memset(ballast, 1, size);
+}
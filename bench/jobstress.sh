@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# jobstress.sh - Run n (10000 by default) background sleepers at once
+#
+# usage: jobstress.sh tsh [n]
+#
+# Starts them all, checks that jobs lists every one as Running with
+# JIDs 1 to n in order, kills each by JID, and checks that jobs is
+# empty once they've been reaped. Exits nonzero if a check fails.
+#
+tsh=${1:?usage: jobstress.sh tsh [n]}
+n=${2:-10000}
+in=$(mktemp) out=$(mktemp)
+trap 'rm -f "$in" "$out"' EXIT
+
+# Each job holds a pidfd, so the shell needs an fd apiece
+ulimit -n $((n + 64)) 2>/dev/null || ulimit -n "$(ulimit -H -n)"
+
+{
+    i=1; while [ $i -le $n ]; do echo "/bin/sleep 1000 &"; i=$((i + 1)); done
+    echo "echo --- listed"
+    echo "jobs"
+    echo "echo --- killed"
+    i=1; while [ $i -le $n ]; do echo "kill %$i"; i=$((i + 1)); done
+    echo "/bin/sleep 1"
+    echo "echo --- left"
+    echo "jobs"
+} > "$in"
+
+start=$(date +%s.%N)
+"$tsh" -p < "$in" > "$out" 2>&1
+end=$(date +%s.%N)
+
+awk -v n=$n -v secs="$(awk "BEGIN { print $end - $start }")" '
+    /^--- / { part = $2; next }
+    part == "listed" && $3 == "Running" {
+        if ($1 != "[" (listed + 1) "]") badorder++
+        listed++
+    }
+    part == "left" { left++ }
+    /[Tt]oo many/ { toomany++ }
+    END {
+        printf("%d jobs in %.1fs: %d listed running, %d out of order, %d left after kill\n",
+               n, secs, listed, badorder, left)
+        exit !(listed == n && !badorder && !left && !toomany)
+    }' "$out"
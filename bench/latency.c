@@ -0,0 +1,135 @@
+/*
+ * latency.c - Measure how long tsh takes to run a command and come back
+ *    to the prompt
+ *
+ * usage: latency [-n N] [-c cmd] tsh [args...]
+ *        Runs tsh (with a prompt) on a pipe, sends it cmd (/bin/sleep 0
+ *        by default, which the shell can't run itself the way it does
+ *        /bin/true) N times (1000 by default), one at a time, and times
+ *        each from writing the line to reading the next "tsh> ". Prints
+ *        the mean, median, 99th percentile and worst time.
+ *
+ * With waitfg sleeping in 1-second steps, every sample was a second or
+ * so; now they're what fork and exec cost.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define PROMPT "tsh> "
+
+long long nsnow(void);
+void waitprompt(int fd);
+int cmpll(const void *a, const void *b);
+
+int main(int argc, char **argv)
+{
+    const char *cmd = "/bin/sleep 0";
+    int n = 1000, c, i, in[2], out[2];
+    long long *ns, sum = 0, start;
+    char line[1024];
+    pid_t pid;
+
+    while ((c = getopt(argc, argv, "+n:c:")) != -1) {
+        switch (c) {
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'c':
+            cmd = optarg;
+            break;
+        default:
+            optind = argc;
+        }
+    }
+    if (optind >= argc || n < 1) {
+        fprintf(stderr, "usage: %s [-n N] [-c cmd] tsh [args...]\n", argv[0]);
+        exit(2);
+    }
+    snprintf(line, sizeof(line), "%s\n", cmd);
+    if (!(ns = malloc(n * sizeof(*ns))) || pipe(in) < 0 || pipe(out) < 0) {
+        perror("latency");
+        exit(1);
+    }
+
+    if ((pid = fork()) == 0) {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        close(in[0]); close(in[1]); close(out[0]); close(out[1]);
+        execvp(argv[optind], argv + optind);
+        perror(argv[optind]);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+
+    waitprompt(out[0]);
+    for (i = 0; i < n; i++) {
+        start = nsnow();
+        if (write(in[1], line, strlen(line)) < 0) {
+            perror("write");
+            exit(1);
+        }
+        waitprompt(out[0]);
+        ns[i] = nsnow() - start;
+        sum += ns[i];
+    }
+    close(in[1]);
+    waitpid(pid, NULL, 0);
+
+    qsort(ns, n, sizeof(*ns), cmpll);
+    printf("%s: %d runs, mean %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+           cmd, n, sum / 1e3 / n, ns[n / 2] / 1e3, ns[(long)n * 99 / 100] / 1e3,
+           ns[n - 1] / 1e3);
+    return 0;
+}
+
+/* nsnow - CLOCK_MONOTONIC now, in ns */
+long long nsnow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* waitprompt - Read from fd until what was read ends in the prompt */
+void waitprompt(int fd)
+{
+    char buf[4096];
+    size_t have = 0;
+    ssize_t r;
+
+    for (;;) {
+        if ((r = read(fd, buf + have, sizeof(buf) - have)) < 0 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            fprintf(stderr, "latency: the shell went away\n");
+            exit(1);
+        }
+        have += r;
+        if (have >= strlen(PROMPT) &&
+            !memcmp(buf + have - strlen(PROMPT), PROMPT, strlen(PROMPT)))
+            return;
+        // Keep just enough of the tail to spot a prompt split across reads
+        if (have > strlen(PROMPT)) {
+            memmove(buf, buf + have - strlen(PROMPT), strlen(PROMPT));
+            have = strlen(PROMPT);
+        }
+    }
+}
+
+/* cmpll - Order long longs for qsort */
+int cmpll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return x < y ? -1 : x > y;
+}
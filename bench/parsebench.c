@@ -0,0 +1,90 @@
+/*
+ * parsebench.c - Measure how fast parseline tokenizes command lines
+ *
+ * usage: parsebench [seconds]
+ *        Tokenizes each of a few kinds of line over and over for about
+ *        seconds (0.5 by default), three times, and prints the best rate
+ *        in MB/s. parseline works in place, so each round copies the
+ *        line fresh first, and that copy is counted too.
+ *
+ * It's linked with tsh.c built with main renamed, and measures whichever
+ * scanner that was compiled with: AVX2 with -mavx2, SSE2 by default on
+ * x86-64, and strcspn with -U__SSE2__.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+int parseline(char *cmdline, char ***argvp);
+
+long long nstime(void);
+char *repeat(const char *word, size_t size);
+double rate(const char *line, double secs);
+
+int main(int argc, char **argv)
+{
+    double secs = argc > 1 ? atof(argv[1]) : 0.5;
+    struct { const char *name; char *line; } lines[] = {
+        {"49-byte pipeline", "/bin/cat < in.txt | /bin/grep -v x | /bin/wc -l &\n"},
+        {"110-byte long path", "/usr/local/share/some/rather/deeply/nested/tool/directory/bin/"
+                               "run-the-tool --with-a-long-option=value input.dat\n"},
+        {"200 KB, plain args", repeat("arg0123456 ", 200 << 10)},
+        {"200 KB, heavily quoted", repeat("\"a b\" 'c d' e\\ f \"g\\\"h\" ", 200 << 10)},
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(lines) / sizeof(lines[0]); i++)
+        printf("%-24s %8.0f MB/s\n", lines[i].name, rate(lines[i].line, secs));
+    return 0;
+}
+
+/* nstime - Return the monotonic clock in nanoseconds */
+long long nstime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* repeat - Return a line of word over and over, about size bytes long */
+char *repeat(const char *word, size_t size)
+{
+    size_t len = strlen(word), n = size / len, i;
+    char *line = malloc(n * len + 2);
+
+    if (!line) {
+        perror("malloc");
+        exit(1);
+    }
+    for (i = 0; i < n; i++)
+        memcpy(line + i * len, word, len);
+    strcpy(line + n * len, "\n");
+    return line;
+}
+
+/* rate - Tokenize a copy of line for about secs, 3 times; return the best MB/s */
+double rate(const char *line, double secs)
+{
+    size_t len = strlen(line) + 1;
+    char *copy = malloc(len), **argv;
+    double best = 0, mbs;
+    long long start, ns, bytes;
+    int round;
+
+    for (round = 0; round < 3; round++) {
+        start = nstime();
+        bytes = 0;
+        do {
+            memcpy(copy, line, len);
+            parseline(copy, &argv);
+            free(argv);
+            bytes += len;
+        } while ((ns = nstime() - start) < secs * 1e9);
+        if ((mbs = bytes / 1e6 / (ns / 1e9)) > best)
+            best = mbs;
+    }
+    free(copy);
+    return best;
+}
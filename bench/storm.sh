@@ -0,0 +1,65 @@
+#!/bin/sh
+#
+# storm.sh - Kill n (3000 by default) background jobs all at once
+#
+# usage: storm.sh tsh [n] [rounds]
+#
+# Starts n sleepers in tsh, then SIGKILLs every one of them from outside
+# the shell in one go, so their exits land together. Checks that the
+# shell reports each job's termination once, that jobs comes back
+# empty and that the shell is still answering. Does that rounds (3 by
+# default) times; exits nonzero if any round fails.
+#
+tsh=${1:?usage: storm.sh tsh [n] [rounds]}
+n=${2:-3000}
+rounds=${3:-3}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+ulimit -n $((n + 64)) 2>/dev/null || ulimit -n "$(ulimit -H -n)"
+
+# waitfor text - Wait up to a minute for the shell to print text
+waitfor() {
+    i=0
+    until grep -q -- "$1" "$dir/out"; do
+        i=$((i + 1))
+        [ $i -le 600 ] || { echo "storm: the shell never printed $1" >&2; return 1; }
+        sleep 0.1
+    done
+}
+
+failed=0
+round=1
+while [ $round -le $rounds ]; do
+    mkfifo "$dir/in"
+    "$tsh" -p < "$dir/in" > "$dir/out" 2>&1 &
+    pid=$!
+    exec 3> "$dir/in"
+
+    i=0; while [ $i -lt $n ]; do echo "/bin/sleep 1000 &"; i=$((i + 1)); done >&3
+    echo "echo --- started" >&3
+    waitfor "^--- started" || failed=1
+    pkill -KILL -P $pid sleep
+
+    # A FG job that outlasts the storm, then the leftovers
+    echo "/bin/sleep 2" >&3
+    echo "echo --- left" >&3
+    echo "jobs" >&3
+    echo "echo --- done" >&3
+    waitfor "^--- done" || failed=1
+    exec 3>&-
+    wait $pid
+
+    awk -v n=$n -v round=$round '
+        /^Job \[[0-9]+\] \([0-9]+\) terminated by signal 9$/ { if (!seen[$2]++) killed++; else twice++ }
+        /^--- left/ { left = 1; next }
+        /^--- done/ { left = 0 }
+        left { leftover++ }
+        END {
+            printf("round %d: %d of %d jobs reported killed, %d twice, %d left\n",
+                   round, killed, n, twice, leftover)
+            exit !(killed == n && !twice && !leftover)
+        }' "$dir/out" || failed=1
+    rm -f "$dir/in"
+    round=$((round + 1))
+done
+exit $failed
@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# utilbench.sh - Compare running echo, printf, test and true in the
+#    shell with exec'ing them
+#
+# usage: utilbench.sh tsh [n]
+#
+# Runs scripts of n (5000 by default) copies of each command and prints
+# the time per command. The exec'd versions are the same programs run
+# through symlinks in a scratch directory, so the shell can't stand in
+# for them.
+#
+tsh=${1:?usage: utilbench.sh tsh [n]}
+n=${2:-5000}
+[ -x "$tsh" ] || { echo "$tsh: not found" >&2; exit 1; }
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+for util in echo printf test true; do
+    ln -s "$(command -v /bin/$util || command -v /usr/bin/$util)" "$dir/$util"
+done
+
+# percmd cmd - Print the microseconds tsh takes per cmd, over n of them
+percmd() {
+    i=0
+    while [ $i -lt $n ]; do echo "$1"; i=$((i + 1)); done > "$dir/script"
+    start=$(date +%s%N)
+    "$tsh" "$dir/script" > /dev/null
+    end=$(date +%s%N)
+    awk "BEGIN { printf(\"%.1f\", ($end - $start) / 1000 / $n) }"
+}
+
+printf "%-24s %12s %12s\n" "per command (us)" "exec'd" "in shell"
+while read -r cmd args; do
+    printf "%-24s %12s %12s\n" "$cmd $args" "$(percmd "$dir/$cmd $args")" "$(percmd "/bin/$cmd $args")"
+done <<EOF
+echo tsh> jobs
+echo hello
+printf %s-%d\n a 1
+test -f /etc/passwd
+true
+EOF
@@ -5,37 +5,138 @@
  * Drexel University
  * ear78
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stddef.h>
 #include <ctype.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <spawn.h>
+#include <sched.h>
+#include <dirent.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <dlfcn.h>
+#include <time.h>
+#include "tsh_plugin.h"
+#include "tsh_shm.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /* Misc manifest constants */
 #define MAXLINE    1024   /* max line size */
-#define MAXARGS     128   /* max args on a command line */
-#define MAXJOBS      16   /* max jobs at any point in time */
+#define MAXARGS      16   /* initial room in argv, which grows as needed */
 #define MAXJID    1<<16   /* max job ID */
+#define MAXEVENTS    16   /* max epoll events handled per wakeup */
+#define HASHSIZE    256   /* buckets in the command hash (power of 2) */
+#define BUILTINHASH  64   /* buckets in the builtin table (power of 2) */
+#define BATCHBUF  65536   /* stdout buffer and read size in batch mode */
+#define NPSI          3   /* PSI resources the governor watches */
+#define PSIWINDOW     2   /* seconds PSI triggers measure stalls over */
+#define GOVLOG       16   /* governor decisions kept for the governor builtin */
+#define HISTCHUNK 65536   /* the history file starts this big, then doubles */
+#define HISTMAGIC "tshhist1" /* first bytes of a history file (no NUL) */
+#define HISTRUNNING  -1   /* status of a history entry that hasn't finished */
+#define NOTES        64   /* room for job notifications at first; it doubles */
+#define TRACERING 65536   /* trace events kept, the oldest overwritten (power of 2) */
+#define LATBITS       7   /* a latency histogram splits each power of 2 in 2^(LATBITS-1) */
+#define LATBUCKETS  ((66 - LATBITS) << (LATBITS - 1)) /* buckets that covers 64 bits */
+#define NPERF         6   /* perf counters a counted job gets */
+
+/* I/O priorities, from linux/ioprio.h, which glibc doesn't wrap */
+#define IOPRIO_WHO_PGRP     2
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_NONE   0   /* follow the CPU nice level */
+#define IOPRIO_CLASS_IDLE   3   /* only when no one else wants the disk */
+
+/* Added in Linux 6.9; older kernels reject it with EINVAL */
+#ifndef PIDFD_SIGNAL_PROCESS_GROUP
+#define PIDFD_SIGNAL_PROCESS_GROUP (1U << 2)
+#endif
+
+/* 
+ * The tokenizer only looks at the bytes in SCANSET (and the NUL at the
+ * end). It finds them a block at a time with whatever vector unit the
+ * compiler is targeting, or with strcspn without one
+ */
+#define SCANSET " \t\n'\"\\"
+#if defined(__AVX2__)
+#define SCANBLOCK    32
+typedef __m256i scanvec_t;
+#define scanload(p)      _mm256_load_si256((const scanvec_t *)(p))
+#define scansplat(c)     _mm256_set1_epi8(c)
+#define scaneq(a, b)     _mm256_cmpeq_epi8(a, b)
+#define scanor(a, b)     _mm256_or_si256(a, b)
+#define scanmask(v)      ((uint32_t)_mm256_movemask_epi8(v))
+#elif defined(__SSE2__)
+#define SCANBLOCK    16
+typedef __m128i scanvec_t;
+#define scanload(p)      _mm_load_si128((const scanvec_t *)(p))
+#define scansplat(c)     _mm_set1_epi8(c)
+#define scaneq(a, b)     _mm_cmpeq_epi8(a, b)
+#define scanor(a, b)     _mm_or_si128(a, b)
+#define scanmask(v)      ((uint32_t)_mm_movemask_epi8(v))
+#endif
 
 /* Job states */
 #define UNDEF 0 /* undefined */
 #define FG 1    /* running in foreground */
 #define BG 2    /* running in background */
 #define ST 3    /* stopped */
+#define PD 4    /* pending (waiting for a background slot) */
+
+/*
+ * TRACE - Record a trace event if tracing is on: name, Chrome trace
+ * phase ph ('B'egin, 'E'nd, 'i'nstant, async 'b'egin and 'e'nd), and
+ * the job and process it's about (0 if none). Off, it costs one
+ * predicted branch.
+ */
+#define TRACE(name, ph, jid, pid) \
+    do { if (__builtin_expect(tracing, 0)) tracepoint(name, ph, jid, pid); } while (0)
+
+/* The latency histograms */
+#define LAT_PARSE  0      /* parseline */
+#define LAT_SPAWN  1      /* starting a stage, up to its exec */
+#define LAT_EXIT   2      /* a job's processes starting to the last one's exit */
+#define LAT_PROMPT 3      /* reaping a FG job to reading the next line */
+#define NLAT       4
+
+/* What a job notification is about */
+#define NOTE_STOPPED 1    /* a job was stopped by a signal */
+#define NOTE_KILLED  2    /* a job was terminated by a signal */
 
 /* 
- * Jobs states: FG (foreground), BG (background), ST (stopped)
+ * Jobs states: FG (foreground), BG (background), ST (stopped),
+ *     PD (pending)
  * Job state transitions and enabling actions:
  *     FG -> ST  : ctrl-z
  *     ST -> FG  : fg command
  *     ST -> BG  : bg command
  *     BG -> FG  : fg command
+ *     PD -> BG  : fewer than bglimit BG jobs, or bg command
+ *     PD -> FG  : fg command
  * At most 1 job can be in the FG state.
  */
 
@@ -43,16 +144,293 @@
 extern char **environ;      /* defined in libc */
 char prompt[] = "tsh> ";    /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;            /* if true, print additional output */
-int nextjid = 1;            /* next job ID to allocate */
+int usefork = 0;            /* if true, launch jobs with fork instead of posix_spawn */
+int batch = 0;              /* if true, running -c or a script rather than a REPL */
+int bglimit = 0;            /* most BG jobs to run at once, 0 for no limit */
 char sbuf[MAXLINE];         /* for composing sprintf messages */
 
+int sigfd = -1;             /* signalfd for SIGCHLD, SIGINT, SIGTSTP, SIGQUIT */
+int evfd = -1;              /* epoll set of job event sources (sigfd, pidfds) */
+int replfd = -1;            /* epoll set of stdin and evfd, used by the REPL */
+int stdin_pollable = 1;     /* false if stdin can't be added to replfd */
+int usepidfd = 1;           /* reap exits through pidfds (if the kernel can) */
+int untracked = 0;          /* children we couldn't get a pidfd for */
+sigset_t child_mask;        /* signal mask that children start out with */
+int holdfds[2] = {-1, -1};  /* pipe held stages wait on until it's closed */
+
+cpu_set_t shellcpus;        /* CPUs the shell may use, and what FG jobs get */
+int ncpus = 0;              /* CPUs in shellcpus, 0 if we can't place jobs */
+int fgcpu = -1;             /* CPU kept free of BG jobs for FG ones, or -1 */
+
+struct psi_t {              /* A resource the pressure governor watches */
+    const char *name;       /* memory, cpu or io, as in /proc/pressure */
+    int limit;              /* % of the time tasks may stall on it, 0 for any */
+    int fd;                 /* its PSI trigger, or -1 if not watched */
+};
+struct psi_t psi[NPSI] = {{"memory", 10, -1}, {"cpu", 50, -1}, {"io", 20, -1}};
+int governing = 0;          /* if true, the governor is on */
+int govtimer = -1;          /* timerfd that ticks while the governor holds jobs */
+int nheld = 0;              /* BG jobs the governor has stopped */
+long long govstop = 0;      /* CLOCK_MONOTONIC ns when it last stopped one */
+char govlog[GOVLOG][128];   /* its latest decisions, oldest overwritten first */
+int ngovlog = 0;            /* decisions logged so far */
+
+struct cmdhash_t {          /* A remembered PATH lookup */
+    char *name;             /* command name as typed */
+    char *path;             /* where PATH found it, NULL if nowhere */
+    int hits;               /* times the entry was used */
+    struct cmdhash_t *next; /* next entry in the bucket */
+};
+struct cmdhash_t *cmdhash[HASHSIZE]; /* The command hash */
+char *hashpath = NULL;      /* PATH the command hash was built for */
+int inotifyfd = -1;         /* watches the PATH directories, or -1 */
+
+struct histhdr_t {          /* The start of the history file */
+    char magic[8];          /* HISTMAGIC */
+    uint64_t end;           /* offset one past the last entry */
+};
+
+struct histrec_t {          /* A history entry, 8-byte aligned in the file */
+    uint32_t len;           /* length of text */
+    int32_t status;         /* wait status of its job, or HISTRUNNING */
+    int64_t when;           /* when it was typed (seconds since the epoch) */
+    int64_t dur;            /* how long it ran (ns) */
+    char text[];            /* the line, without its newline, NUL terminated */
+};
+
+struct trigram_t {          /* The entries holding three bytes in a row */
+    uint32_t key;           /* the bytes, or 1<<24 plus the first three of a line; 0 if unused */
+    int n;                  /* entries it's in */
+    int cap;                /* room in ids */
+    uint32_t *ids;          /* their indexes in recs, in ascending order */
+};
+
+struct histindex_t {        /* What's known of the history file */
+    uint64_t end;           /* offset it has been read up to */
+    uint64_t *recs;         /* offset of every entry read, oldest first */
+    int nrecs;              /* entries read */
+    int reccap;             /* room in recs */
+    struct trigram_t *grams; /* open addressed trigram table, NULL until searched */
+    int ngrams;             /* trigrams in it */
+    int gramcap;            /* its size (a power of 2) */
+};
+
+int histfd = -1;            /* the history file, or -1 if there's no history */
+struct histhdr_t *hist = NULL; /* the history file, mapped */
+size_t histcap = 0;         /* bytes of it mapped */
+struct histindex_t histidx; /* index of its entries */
+uint64_t histpending = 0;   /* entry of the line being run, until a job takes it */
+int localstatus = 0;        /* wait status of the last stage run in the shell */
+
+struct note_t {             /* Something to tell the user about a job */
+    int what;               /* NOTE_STOPPED or NOTE_KILLED */
+    int jid;                /* the job's ID */
+    pid_t pid;              /* and PID */
+    int sig;                /* the signal that did it */
+};
+
+struct notes_t {            /* Notifications from the reaper to the REPL */
+    struct note_t *notes;   /* in the order they were posted */
+    int n;                  /* notes posted and not printed yet */
+    int cap;                /* room in notes */
+};
+struct notes_t notes;       /* Job notifications not printed yet */
+
+struct trace_t {            /* A trace event */
+    long long ns;           /* CLOCK_MONOTONIC ns when it happened */
+    const char *name;       /* what happened (a string constant) */
+    char ph;                /* its Chrome trace event phase */
+    int jid;                /* the job it's about, or 0 */
+    pid_t pid;              /* the process it's about, or 0 */
+};
+int tracing = 0;            /* record trace events? */
+struct trace_t *traces = NULL; /* TRACERING of them, allocated when first turned on */
+unsigned long ntraces = 0;  /* events recorded, including those overwritten */
+char *tracefile = NULL;     /* where -T writes the trace on exit, or NULL */
+pid_t tracepid = 0;         /* the shell's PID, for the trace and atexit */
+
+struct latency_t {          /* An HDR-style log-linear latency histogram */
+    const char *name;       /* what it measures */
+    unsigned long long count; /* values recorded */
+    unsigned long long sum; /* their total (ns) */
+    unsigned long long max; /* the largest (ns) */
+    unsigned counts[LATBUCKETS]; /* values in each bucket; see latbucket */
+};
+struct latency_t latency[NLAT] = {
+    [LAT_PARSE] = { .name = "parse" },
+    [LAT_SPAWN] = { .name = "spawn" },
+    [LAT_EXIT] = { .name = "exit" },
+    [LAT_PROMPT] = { .name = "prompt" },
+};
+long long fgreaped = 0;     /* when a FG job was last reaped, until the next line */
+
+struct linestr_t {          /* An interned command line */
+    struct linestr_t *next; /* next entry in the bucket */
+    unsigned hash;          /* hash of text */
+    int refs;               /* jobs using it */
+    char text[];            /* the line itself, NUL terminated */
+};
+
+struct linepool_t {         /* The command line pool */
+    struct linestr_t **buckets; /* chained hash of the lines in use */
+    int nbuckets;           /* buckets, a power of 2 */
+    int nlines;             /* distinct lines in the pool */
+    size_t bytes;           /* bytes allocated for them */
+};
+struct linepool_t linepool; /* Where job command lines live */
+
+char *inbuf = NULL;         /* buffered input that hasn't been consumed yet */
+size_t incap = 0;           /* bytes allocated for inbuf */
+size_t inlen = 0;           /* number of valid bytes in inbuf */
+
+struct scan_t {             /* Where the tokenizer is in a line */
+    char *block;            /* block being scanned (the next byte, if scalar) */
+    uint32_t mask;          /* bytes of block from SCANSET not returned yet */
+};
+
+struct stage_t {            /* One command of a pipeline */
+    char **argv;            /* its arguments, NULL terminated */
+    char *infile;           /* file named by <, or NULL */
+    char *outfile;          /* file named by >, or NULL */
+};
+
+struct builtin_t {          /* A command the shell runs itself */
+    const char *name;       /* what it's run as */
+    void (*cmd)(char **argv, int bg, char *cmdline); /* runs a whole line, or NULL */
+    tsh_builtin_fn fn;      /* runs it as a pipeline stage, or NULL */
+    int standin;            /* also run it for /bin/name and /usr/bin/name? */
+    const char *lib;        /* the plugin it came from, NULL if built in */
+    struct builtin_t *next; /* next entry in the bucket */
+};
+struct builtin_t *builtins[BUILTINHASH]; /* The builtin dispatch table */
+
+struct testargs_t {         /* Where test is in its arguments */
+    char **arg;             /* the next one */
+    char **end;             /* one past the last one */
+    int err;                /* set on a syntax error */
+};
+
+struct perf_t {             /* The perf counters of a job */
+    int *fds;               /* NPERF counters per stage, -1 where there's none */
+    int nfds;               /* room in fds */
+    uint64_t counts[NPERF]; /* what the reaped stages counted */
+    int report;             /* print them when the job is done (perfstat)? */
+};
+
+struct perfevent_t {        /* A perf event jobs are counted with */
+    const char *name;       /* what perf stat calls it */
+    uint32_t type;          /* PERF_TYPE_SOFTWARE or PERF_TYPE_HARDWARE */
+    uint64_t config;        /* which one */
+    int err;                /* errno from the first failed open, 0 if none yet */
+};
+
+struct perfevent_t perfevents[NPERF] = {
+    { .name = "task-clock", .type = PERF_TYPE_SOFTWARE, .config = PERF_COUNT_SW_TASK_CLOCK },
+    { .name = "context-switches", .type = PERF_TYPE_SOFTWARE, .config = PERF_COUNT_SW_CONTEXT_SWITCHES },
+    { .name = "cpu-migrations", .type = PERF_TYPE_SOFTWARE, .config = PERF_COUNT_SW_CPU_MIGRATIONS },
+    { .name = "page-faults", .type = PERF_TYPE_SOFTWARE, .config = PERF_COUNT_SW_PAGE_FAULTS },
+    { .name = "cycles", .type = PERF_TYPE_HARDWARE, .config = PERF_COUNT_HW_CPU_CYCLES },
+    { .name = "instructions", .type = PERF_TYPE_HARDWARE, .config = PERF_COUNT_HW_INSTRUCTIONS },
+};
+int perfall = 0;            /* count every job (perfstat -a on)? */
+int perfnext = 0;           /* count and report the job perfstat is starting? */
+
+struct jtopproc_t {         /* A process jtop has seen in /proc */
+    pid_t pid;              /* its PID */
+    int jid;                /* the job whose group it's in, 0 if none, -1 if not known yet */
+    int statfd;             /* its /proc stat, statm and io, opened when */
+    int statmfd;            /*   first read and kept for the next sample, */
+    int iofd;               /*   or -1 */
+    unsigned long long ticks; /* CPU time it had used at the last sample (clock ticks) */
+    unsigned long long rchar; /* bytes it had read then */
+    unsigned long long wchar; /* and written */
+    long long when;         /* CLOCK_BOOTTIME ns of the last sample */
+};
+
+struct jtop_t {             /* What jtop is watching */
+    DIR *proc;              /* /proc, read again every sample */
+    struct jtopproc_t *procs; /* every process in it, in PID order */
+    int nprocs;             /* processes in procs */
+    pid_t *pids;            /* the PIDs the last read of /proc found */
+    int pidcap;             /* room in pids */
+};
+
+struct jtopjob_t {          /* A job's share of one jtop sample */
+    int nprocs;             /* live processes in its group */
+    int nthreads;           /* their threads */
+    double cpu;             /* % of a CPU they used since the last sample */
+    unsigned long long rss; /* their resident memory (bytes) */
+    double rrate;           /* bytes/s they read */
+    double wrate;           /* and wrote */
+};
+int interrupted = 0;        /* set by a ctrl-c with no FG job to send it to */
+
+struct proc_t {             /* One process of a job */
+    pid_t pid;              /* its PID, 0 once it has been reaped */
+    int pidfd;              /* its pidfd, or -1 */
+    int local;              /* runs a utility in a fork, and never execs? */
+};
+
 struct job_t {              /* The job struct */
-    pid_t pid;              /* job PID */
+    pid_t pid;              /* job PID (first stage, process group ID) */
     int jid;                /* job ID [1, 2, ...] */
-    int state;              /* UNDEF, BG, FG, or ST */
-    char cmdline[MAXLINE];  /* command line */
+    int state;              /* UNDEF, BG, FG, ST, or PD */
+    int nprocs;             /* number of pipeline stages */
+    int nlive;              /* stages that haven't been reaped yet */
+    int status;             /* wait status of the last stage */
+    struct proc_t *procs;   /* every stage, in pipeline order */
+    struct job_t *next;     /* next record on the free or pending list */
+    char *cmdline;          /* command line, interned in the line pool */
+    long long start;        /* CLOCK_MONOTONIC ns when it was started */
+    struct rusage ru;       /* resources used by the stages reaped so far */
+    int timed;              /* report its resource use when it's done? */
+    struct queue_t *queue;  /* work queue of a parallel job, or NULL */
+    int prio;               /* where it waits when pending, lower goes first */
+    cpu_set_t *cpus;        /* CPUs it's pinned to, NULL for shellcpus */
+    int pinned;             /* were cpus set by hand with pin? */
+    int nice;               /* nice level given with nice or renice */
+    int held;               /* stopped by the pressure governor? */
+    uint64_t hist;          /* its history entry (file offset), or 0 */
+    long long launched;     /* CLOCK_MONOTONIC ns when its processes had started */
+    struct perf_t *perf;    /* its perf counters, or NULL if it isn't counted */
+};
+
+struct queue_t {            /* The work queue of a parallel job */
+    char **tmpl;            /* command template, NULL terminated */
+    int subst;              /* does tmpl hold {}? (if not, items are appended) */
+    char *buf;              /* the item lines */
+    char **items;           /* each item, NUL terminated in buf */
+    int nitems;             /* number of items */
+    int next;               /* index of the next item to start */
+    int done;               /* items that have finished */
+    int failed;             /* items that exited nonzero or couldn't start */
+    int cancelled;          /* stop starting items (the job was killed) */
+};
+
+struct pidslot_t {          /* One slot of the PID index */
+    pid_t pid;              /* a stage PID, 0 if the slot is empty */
+    struct job_t *job;      /* the job it belongs to */
+};
+
+struct joblist_t {          /* The job list struct */
+    struct job_t **byjid;   /* jobs indexed by JID, NULL where unused */
+    int jidcap;             /* slots in byjid */
+    int maxjid;             /* largest JID in use, 0 if none */
+    int njobs;              /* jobs on the list */
+    struct pidslot_t *bypid;/* open-addressed hash of every stage PID */
+    int pidcap;             /* slots in bypid, a power of 2 */
+    int npids;              /* PIDs in bypid */
+    struct job_t *fg;       /* the FG job, or NULL */
+    int nbg;                /* jobs in the BG state */
+    struct job_t *pending;  /* PD jobs, in the order they'll start */
+    struct job_t *free;     /* cleared job records ready for reuse */
 };
-struct job_t jobs[MAXJOBS]; /* The job list */
+struct joblist_t jobs[1];   /* The job list (an array, so it passes by reference) */
+
+struct tsh_shm *shm = NULL; /* the job table published with -S, mapped, or NULL */
+int shmfd = -1;             /* its file */
+char shmpath[64];           /* and where that is */
+pid_t shmpid = 0;           /* the shell's PID, which removes it on exit */
 /* End global variables */
 
 
@@ -60,34 +438,200 @@ struct job_t jobs[MAXJOBS]; /* The job list */
 
 /* Here are the functions that you will implement */
 void eval(char *cmdline);
-int builtin_cmd(char **argv);
-void do_bgfg(char **argv);
+int runjob(char **argv, int bg, char *cmdline, int timed, int nice);
+int jobprefix(char **argv, int *timed, int *nice, int *perf);
+void runlines(char *buf, size_t len);
+void runscript(const char *path);
+char *readfd(int fd, size_t *lenp);
+int builtin_cmd(char **argv, int bg, char *cmdline);
+void do_quit(char **argv, int bg, char *cmdline);
+void do_nothing(char **argv, int bg, char *cmdline);
+void do_jobs(char **argv, int bg, char *cmdline);
+void do_kill(char **argv, int bg, char *cmdline);
+void do_bgfg(char **argv, int bg, char *cmdline);
+void do_parallel(char **argv, int bg, char *cmdline);
+void do_bglimit(char **argv, int bg, char *cmdline);
+void do_pin(char **argv, int bg, char *cmdline);
+void do_renice(char **argv, int bg, char *cmdline);
+void do_governor(char **argv, int bg, char *cmdline);
+int runqueue(struct job_t *job);
+pid_t startitem(struct queue_t *queue, char *item, pid_t pgid);
 void waitfg(pid_t pid);
 
+void initbuiltins(void);
+unsigned builtinhash(const char *name);
+const struct builtin_t *findbuiltin(const char *name);
+void addbuiltin(struct builtin_t *b);
+void do_enable(char **argv, int bg, char *cmdline);
+void do_history(char **argv, int bg, char *cmdline);
+int cmpbuiltin(const void *a, const void *b);
+int loadplugin(const char *lib, char **names);
+const struct builtin_t *findutil(const char *name, int standin);
+int runlocal(const struct builtin_t *util, struct stage_t *stage, int infd, int outfd);
+pid_t forklocal(const struct builtin_t *util, struct stage_t *stage, pid_t pgid, int infd, int outfd);
+int do_echo(int argc, char **argv, int infd, int outfd);
+int do_printf(int argc, char **argv, int infd, int outfd);
+int do_test(int argc, char **argv, int infd, int outfd);
+int do_true(int argc, char **argv, int infd, int outfd);
+int do_false(int argc, char **argv, int infd, int outfd);
+const char *putescape(const char *s, int octal0, int *stop);
+long long numarg(const char *s, int *status);
+int testor(struct testargs_t *t);
+int testand(struct testargs_t *t);
+int testnot(struct testargs_t *t);
+int testprimary(struct testargs_t *t);
+int testunary(const char *op, const char *arg, struct testargs_t *t);
+int testbinary(const char *a, const char *op, const char *b, struct testargs_t *t);
+
 void sigchld_handler(int sig);
 void sigtstp_handler(int sig);
 void sigint_handler(int sig);
 
 /* Here are helper routines that we've provided for you */
-int parseline(const char *cmdline, char **argv); 
+int parseline(char *cmdline, char ***argvp); 
+void scaninit(struct scan_t *sc, char *p);
+char *scannext(struct scan_t *sc);
+#ifdef SCANBLOCK
+uint32_t scanblock(const char *block);
+#endif
 void sigquit_handler(int sig);
 
+void initevents(void);
+void dispatch_events(int timeout);
+void handle_signals(void);
+int readline(char **linep, size_t *capp);
+int continued(const char *line, size_t len);
+int splitstages(char **argv, struct stage_t *stages);
+int countstages(char **argv);
+int startstages(char **argv, struct proc_t *procs, int bg, int held);
+int startjob(struct job_t *job, int state);
+void admitjobs(void);
+pid_t launch(struct stage_t *stage, pid_t pgid, int infd, int outfd);
+pid_t spawn(char **argv, pid_t pgid, int infd, int outfd);
+void holdstages(void);
+void waithold(void);
+void releasestages(void);
+int trackchild(pid_t pid);
+void reap_pidfd(int pidfd, pid_t pid);
+void update_job(pid_t pid, int status, const struct rusage *ru);
+int wstatus(const siginfo_t *si);
+void postnote(int what, struct job_t *job, int sig);
+void drainnotes(void);
+void tracepoint(const char *name, char ph, int jid, pid_t pid);
+void starttrace(void);
+int dumptrace(FILE *fp);
+void savetrace(void);
+void do_trace(char **argv, int bg, char *cmdline);
+int latbucket(unsigned long long ns);
+unsigned long long latvalue(int bucket);
+void latrecord(int lat, long long ns);
+unsigned long long latpercentile(const struct latency_t *l, double p);
+char *fmtns(unsigned long long ns, char *buf, size_t size);
+void do_stats(char **argv, int bg, char *cmdline);
+void perfjob(struct job_t *job, int report);
+int perfopen(int event, pid_t pid, int onexec);
+uint64_t perfread(int fd);
+void perfreap(struct job_t *job, int stage);
+void perfcounts(struct job_t *job, uint64_t *counts);
+void perffree(struct job_t *job);
+void perfreport(struct job_t *job);
+void perfjobs(struct joblist_t *jobs);
+void do_perfstat(char **argv, int bg, char *cmdline);
+void do_jtop(char **argv, int bg, char *cmdline);
+void jtopsample(struct jtop_t *top, struct jtopjob_t *sums, int nsums);
+int jtopproc(struct jtopproc_t *p, long long now, struct jtopjob_t *sums, int nsums);
+int procfile(pid_t pid, const char *name, int *fd, char *buf, size_t size);
+void jtopclose(struct jtopproc_t *p);
+void jtopdraw(struct jtop_t *top, struct jtopjob_t *sums, double delay, int tty);
+void jtopfree(struct jtop_t *top);
+int cmppid(const void *a, const void *b);
+char *fmtbytes(double n, char *buf, size_t size);
+void startpublish(void);
+int growpublish(int nslots);
+void publishjob(struct job_t *job);
+void unpublishjob(struct job_t *job);
+void publishtotals(void);
+void shmlock(void);
+void shmunlock(void);
+void stoppublish(void);
+int waitru(idtype_t idtype, id_t id, siginfo_t *si, int options, struct rusage *ru);
+int signaljob(struct job_t *job, int sig);
+
+char *findcmd(char *name);
+char *searchpath(const char *path, const char *name);
+void clearhash(void);
+void watchpath(const char *path);
+void listhash(void);
+
+void initcpus(void);
+cpu_set_t *pickcpus(int n);
+void placejob(struct job_t *job);
+void pinjob(struct job_t *job, cpu_set_t *cpus);
+int pinpid(pid_t pid, const cpu_set_t *cpus);
+int pintid(pid_t tid, const void *arg);
+int schedtid(pid_t tid, const void *arg);
+void schedjob(struct job_t *job);
+void eachthread(pid_t pid, int (*fn)(pid_t tid, const void *arg), const void *arg);
+void bindshell(const cpu_set_t *cpus);
+int parsecpus(const char *list, cpu_set_t *cpus);
+char *formatcpus(const cpu_set_t *cpus, char *buf, size_t size);
+
+int startgovernor(void);
+void stopgovernor(void);
+void govern(struct psi_t *res);
+void govtick(void);
+void closetriggers(void);
+void holdjob(struct job_t *job, int hold);
+void resumejob(struct job_t *job);
+double psiavg(struct psi_t *res);
+void govnote(const char *fmt, ...);
+void do_hash(char **argv, int bg, char *cmdline);
+
+void inithist(void);
+int histmap(void);
+uint64_t histadd(const char *line);
+void histdone(uint64_t off, int status, long long dur);
+struct histrec_t *histrec(int id);
+void histscan(void);
+void histgrams(void);
+void histindex(int id);
+struct trigram_t *findgram(uint32_t key, int add);
+void addgram(uint32_t key, uint32_t id);
+void histfind(const char *pat, int prefix);
+void printhist(int id);
+
 void clearjob(struct job_t *job);
-void initjobs(struct job_t *jobs);
-int maxjid(struct job_t *jobs); 
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline);
-int deletejob(struct job_t *jobs, pid_t pid); 
-pid_t fgpid(struct job_t *jobs);
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
-struct job_t *getjobjid(struct job_t *jobs, int jid); 
+void initjobs(struct joblist_t *jobs);
+int maxjid(struct joblist_t *jobs); 
+int hashpid(struct joblist_t *jobs, pid_t pid);
+void indexpid(struct joblist_t *jobs, pid_t pid, struct job_t *job);
+void unindexpid(struct joblist_t *jobs, pid_t pid);
+void setjobstate(struct joblist_t *jobs, struct job_t *job, int state);
+int addjob(struct joblist_t *jobs, struct proc_t *procs, int nprocs, int state, char *cmdline);
+int deletejob(struct joblist_t *jobs, pid_t pid); 
+void removejob(struct joblist_t *jobs, struct job_t *job);
+void attachprocs(struct joblist_t *jobs, struct job_t *job, struct proc_t *procs, int nprocs);
+void queuejob(struct joblist_t *jobs, struct job_t *job);
+void dequeuejob(struct joblist_t *jobs, struct job_t *job);
+pid_t fgpid(struct joblist_t *jobs);
+struct job_t *getjobpid(struct joblist_t *jobs, pid_t pid);
+struct job_t *getjobjid(struct joblist_t *jobs, int jid); 
+struct proc_t *getproc(struct job_t *job, pid_t pid);
 int pid2jid(pid_t pid); 
-void listjobs(struct job_t *jobs);
+void listjobs(struct joblist_t *jobs);
+void memjobs(struct joblist_t *jobs, char *cmdline);
+void listusage(struct joblist_t *jobs);
+long long nsnow(void);
+void addrusage(struct rusage *sum, const struct rusage *ru);
+int procusage(pid_t pid, struct rusage *ru);
+void printusage(long long ns, const struct rusage *ru);
+char *internline(const char *line);
+char *holdline(char *line);
+void releaseline(char *line);
 
 void usage(void);
 void unix_error(char *msg);
 void app_error(char *msg);
-typedef void handler_t(int);
-handler_t *Signal(int signum, handler_t *handler);
 
 /*
  * main - The shell's main routine 
@@ -95,15 +639,20 @@ handler_t *Signal(int signum, handler_t *handler);
 int main(int argc, char **argv) 
 {
     char c;
-    char cmdline[MAXLINE];
+    char *cmdline = NULL;
+    char *cmds = NULL;   /* commands given with -c */
+    size_t cmdcap = 0, len;
     int emit_prompt = 1; /* emit prompt (default) */
+    int publish = 0;     /* publish the job table (-S) */
+    struct rlimit rl;
+    long long start;
 
     /* Redirect stderr to stdout (so that driver will get all output
      * on the pipe connected to stdout) */
     dup2(1, 2);
 
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != EOF) {
+    while ((c = getopt(argc, argv, "hvpfSc:T:")) != EOF) {
         switch (c) {
         case 'h':             /* print help message */
             usage();
@@ -114,42 +663,101 @@ int main(int argc, char **argv)
         case 'p':             /* don't print a prompt */
             emit_prompt = 0;  /* handy for automatic testing */
             break;
+        case 'f':             /* launch jobs with plain fork */
+            usefork = 1;
+            break;
+        case 'c':             /* run the given commands and exit */
+            cmds = optarg;
+            break;
+        case 'T':             /* trace the jobs, writing the trace on exit */
+            tracefile = optarg;
+            break;
+        case 'S':             /* publish the job table in /dev/shm */
+            publish = 1;
+            break;
         default:
             usage();
         }
     }
 
-    /* Install the signal handlers */
+    /* Without a user to answer, output only has to be out before
+     * children write theirs, so buffer it in blocks */
+    if ((batch = cmds || optind < argc))
+        setvbuf(stdout, NULL, _IOFBF, BATCHBUF);
 
-    /* These are the ones you will need to implement */
-    Signal(SIGINT,  sigint_handler);   /* ctrl-c */
-    Signal(SIGTSTP, sigtstp_handler);  /* ctrl-z */
-    Signal(SIGCHLD, sigchld_handler);  /* Terminated or stopped child */
-
-    /* This one provides a clean way to kill the shell */
-    Signal(SIGQUIT, sigquit_handler); 
+    /* Route ctrl-c, ctrl-z, SIGCHLD and SIGQUIT through the event loop */
+    initevents();
 
     /* Initialize the job list */
     initjobs(jobs);
 
+    /* Let monitors see it, if asked to */
+    if (publish)
+        startpublish();
+
+    /* Find out which CPUs there are to place BG jobs on */
+    initcpus();
+
+    /* Index the builtin commands */
+    initbuiltins();
+
+    /* Trace from the start, if asked to */
+    if (tracefile) {
+        starttrace();
+        atexit(savetrace);
+    }
+
+    /* Every child holds a pidfd, so allow as many fds as we're permitted */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max){
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    /* Run the -c commands or the script, if we were given either */
+    if (cmds) {
+        len = strlen(cmds);
+        if (!(cmdline = malloc(len + 2)))
+            unix_error("malloc error");
+        memcpy(cmdline, cmds, len);
+        runlines(cmdline, len);
+        exit(0);
+    }
+    if (optind < argc) {
+        runscript(argv[optind]);
+        exit(0);
+    }
+
+    /* Keep what's typed, if there's somewhere to keep it */
+    inithist();
+
     /* Execute the shell's read/eval loop */
     while (1) {
 
         /* Read command line */
+        drainnotes();
+        if (fgreaped) {
+            latrecord(LAT_PROMPT, nsnow() - fgreaped);
+            fgreaped = 0;
+        }
         if (emit_prompt) {
             printf("%s", prompt);
             fflush(stdout);
         }
-        if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-            app_error("fgets error");
-        if (feof(stdin)) { /* End of file (ctrl-d) */
+        TRACE("read", 'B', 0, 0);
+        if (!readline(&cmdline, &cmdcap)) { /* End of file (ctrl-d) */
             fflush(stdout);
             exit(0);
         }
+        TRACE("read", 'E', 0, 0);
 
-        /* Evaluate the command line */
+        /* Evaluate the command line. Its job finishes its history
+         * entry; without one, it's done when eval returns */
+        start = nsnow();
+        localstatus = 0;
+        histpending = histadd(cmdline);
         eval(cmdline);
-        fflush(stdout);
+        histdone(histpending, localstatus, nsnow() - start);
+        histpending = 0;
         fflush(stdout);
     } 
 
@@ -168,173 +776,430 @@ int main(int argc, char **argv)
  * when we type ctrl-c (ctrl-z) at the keyboard.  
 */
 void eval(char *cmdline) {
-    // Prepare a signal set to block and unblock (race conditions)
-    sigset_t signal_set;
-    sigemptyset(&signal_set);
-    sigaddset(&signal_set, SIGCHLD);
+    char **argv, **args;
+    char *line;
+    int bg, timed, nice;
+    struct rusage before, after;
+    long long start;
+    const struct builtin_t *b;
 
-    char* argv[MAXARGS];
-    int bg;
-    pid_t pid;
+    TRACE("eval", 'B', 0, 0);
+
+    // Keep the line as typed; parseline tokenizes cmdline in place
+    line = internline(cmdline);
 
     // Grab our argv array, check to see whether we are running bg or fg
-    bg = parseline(cmdline, argv);
-    // return on empty arguments
-    if (argv[0] == NULL)
-        return;
+    TRACE("parse", 'B', 0, 0);
+    start = nsnow();
+    bg = parseline(cmdline, &argv);
+    latrecord(LAT_PARSE, nsnow() - start);
+    TRACE("parse", 'E', 0, 0);
 
-    // Try to execute a builtin command
-    if (!builtin_cmd(argv)){
-        // Block sigchld to prevent race conditions
-        sigprocmask(SIG_BLOCK, &signal_set, NULL);
+    // A leading time reports what the rest of the line used. Jobs are
+    // reported when they finish; builtins run in the shell, so they
+    // are charged with what the shell used meanwhile (and aren't niced).
+    // perfstat can't count them, as they never leave the shell
+    args = argv + jobprefix(argv, &timed, &nice, &perfnext);
+    start = nsnow();
+    getrusage(RUSAGE_SELF, &before);
 
-        int infd = 0;
-        int outfd = 0;
-        int pipe_fds[2] = {-1, -1};
-        char **arg = argv;
-        char **argv2 = NULL;
-
-        // Attempt to open any output redirection, and split the argv array
-        while (*arg){
-            if (!strcmp(*arg, "<")){
-                // Open an input file
-                if ((infd = open(*(arg + 1), O_RDONLY)) < 0)
-                    perror("Could not open file for reading");
-                *arg = NULL;
-            } else if (!strcmp(*arg, "|")){
-                // Open a pipe
-                if (pipe(pipe_fds) < 0)
-                    unix_error("pipe");
-                *arg = NULL;
-                argv2 = arg + 1;
-            } else if (!strcmp(*arg, ">")){
-                // Open an output file
-                if ((outfd = open(*(arg + 1), O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
-                    perror("Could not open file for writing");
-                *arg = NULL;
-            }
-            arg++;
-        }
+    // Try to execute a builtin command, skipping empty lines. A lone
+    // utility runs in the shell and starts no job, unless it's counted
+    if (args[0] == NULL)
+        ;
+    else if (perfnext && (b = findbuiltin(args[0])) && b->cmd)
+        printf("perfstat: %s: a shell builtin can't be counted\n", args[0]);
+    else if (!builtin_cmd(args, bg, line) && runjob(args, bg, line, timed, nice))
+        ;
+    else if (timed && getrusage(RUSAGE_SELF, &after) == 0) {
+        timersub(&after.ru_utime, &before.ru_utime, &after.ru_utime);
+        timersub(&after.ru_stime, &before.ru_stime, &after.ru_stime);
+        after.ru_minflt -= before.ru_minflt;
+        after.ru_majflt -= before.ru_majflt;
+        after.ru_nvcsw -= before.ru_nvcsw;
+        after.ru_nivcsw -= before.ru_nivcsw;
+        printusage(nsnow() - start, &after);
+    }
+    perfnext = 0;
+    free(argv);
+    releaseline(line);
+    TRACE("eval", 'E', 0, 0);
+}
 
-        pid = fork();
-        if (pid < 0)
-            unix_error("fork");
-        if (pid == 0){
-            // unblock for the child process
-            sigprocmask(SIG_UNBLOCK, &signal_set, NULL);
-            setpgid(0, 0);
-            // Redirect standard input, if appropriate
-            if (infd > 0){
-                dup2(infd, 0);
-                close(infd);
-            }
-            // Redirect standard output, if appropriate
-            if (pipe_fds[1] > 0){
-                // Connect stdout to the out port of the pipe
-                dup2(pipe_fds[1], 1);
-                close(pipe_fds[0]);
-                close(pipe_fds[1]);
-            } else if (outfd > 0){
-                dup2(outfd, 1);
-                close(outfd);
-            }
-            if (execve(argv[0], argv, environ) < 0){
-                printf("%s: command not found.\n", argv[0]);
-                exit(0);
-            }
-        }
+/*
+ * jobprefix - Return how many words at the start of argv set up the job
+ *    rather than being part of it: time, which sets *timed, perfstat,
+ *    which sets *perf, and nice [-n N], which sets *nice (to 10
+ *    without -n)
+ */
+int jobprefix(char **argv, int *timed, int *nice, int *perf) {
+    char **arg = argv, *end;
+    long n;
 
-        // If a pipe was detected, execute the second process
-        if (argv2 != NULL){
-            pid_t pid2 = fork();
-            if (pid2 < 0)
-                unix_error("fork");
-            if (pid2 == 0){
-                // Unblock for the child proecss
-                sigprocmask(SIG_UNBLOCK, &signal_set, NULL);
-                // Add this process to the process group of the first
-                setpgid(pid, pid);
-                // Pipe stdin to the input port of our pipe
-                dup2(pipe_fds[0], 0);
-                close(pipe_fds[0]);
-                close(pipe_fds[1]);
-                // Redirect stdout, if appropriate
-                if (outfd > 0){
-                    dup2(outfd, 1);
-                    close(outfd);
-                }
-                if (execve(argv2[0], argv2, environ) < 0){
-                    printf("%s: command not found.\n", argv[0]);
-                    exit(0);
-                }
+    *timed = *nice = *perf = 0;
+    while (*arg && arg[1]){
+        if (!strcmp(*arg, "time") && !*timed){
+            *timed = 1;
+            arg++;
+        } else if (!strcmp(*arg, "perfstat") && strcmp(arg[1], "-a") && !*perf){
+            *perf = 1;
+            arg++;
+        } else if (!strcmp(*arg, "nice")){
+            *nice = 10;
+            arg++;
+            if (!strcmp(*arg, "-n") && arg[1] && arg[2]){
+                n = strtol(arg[1], &end, 10);
+                if (end == arg[1] || *end)
+                    break;
+                *nice = n < -20 ? -20 : n > 19 ? 19 : n;
+                arg += 2;
             }
-        }
+        } else
+            break;
+    }
+    return arg - argv;
+}
+
+/*
+ * runjob - Start the pipeline in argv as a job, in the background if bg
+ *    is set, and wait for it otherwise. cmdline is the interned line it
+ *    came from. If timed is set, its resource use is printed when it's
+ *    done (and its perf counters, if perfnext is), and it runs at nice
+ *    level nice. A background job that would
+ *    go over bglimit is left pending, and one that starts is demoted.
+ *    Returns 0 if no job was started or queued.
+ */
+int runjob(char **argv, int bg, char *cmdline, int timed, int nice) {
+    int nstages = countstages(argv), nprocs;
+    struct proc_t *procs;
+    struct stage_t *stages;
+    struct job_t *job;
+    cpu_set_t *cpus = NULL;
+    long long start;
+
+    // Queue it to be started from cmdline later. It has to parse now,
+    // while the user is still looking
+    if (bg && bglimit && jobs->nbg >= bglimit) {
+        if (!(stages = malloc(nstages * sizeof(*stages))))
+            unix_error("malloc error");
+        nprocs = splitstages(argv, stages);
+        free(stages);
+        if (nprocs < 0)
+            return 0;
+        addjob(jobs, NULL, 0, PD, cmdline);
+        job = getjobjid(jobs, maxjid(jobs));
+        job->timed = timed;
+        job->nice = job->prio = nice;
+        if (perfall || perfnext)
+            perfjob(job, perfnext);
+        queuejob(jobs, job);
+        printf("[%d] Pending %s", job->jid, cmdline);
+        return 1;
+    }
+
+    // A BG job goes on the least loaded CPUs. The children inherit the
+    // shell's affinity, so it's set before they exist, not after
+    if (bg && (cpus = pickcpus(nstages)))
+        bindshell(cpus);
+
+    // Nothing to do if no command could be started
+    if (!(procs = malloc(nstages * sizeof(*procs))))
+        unix_error("malloc error");
+    start = nsnow();
+    nprocs = startstages(argv, procs, bg, perfall || perfnext);
+    if (cpus)
+        bindshell(NULL);
+    if (nprocs <= 0){
+        releasestages();
+        free(procs);
+        free(cpus);
+        return 0;
+    }
+
+    // Add the new job to the job pool. Exits are only reaped from
+    // the event loop, so the children can't beat us to it
+    addjob(jobs, procs, nprocs, (bg ? BG : FG) , cmdline);
+    job = getjobpid(jobs, procs[0].pid);
+    free(procs);
+    job->start = start;
+    job->timed = timed;
+    job->cpus = cpus;
+    job->nice = nice;
+    // A counted job's stages wait for their counters before they exec
+    if (perfall || perfnext)
+        perfjob(job, perfnext);
+    releasestages();
+    if (bg || nice)
+        schedjob(job);
+    if (!bg){
+        // If we're a fg process, wait for it to complete
+        waitfg(job->pid);
+    } else
+        printf("[%d] (%d) %s", job->jid, job->pid, cmdline);
+    return 1;
+}
+
+/* countstages - Return the number of stages in the pipeline in argv */
+int countstages(char **argv) {
+    int nstages = 1;
+
+    for (; *argv; argv++)
+        if (!strcmp(*argv, "|"))
+            nstages++;
+    return nstages;
+}
+
+/*
+ * startstages - Start the pipeline in argv, filling procs (which has
+ *    room for countstages(argv)) with the stages that started. A lone
+ *    utility runs in the shell instead, and starts nothing, unless bg or
+ *    held is set; utilities in a pipeline or a BG job run in a fork. A
+ *    BG job execs /bin/echo and the like rather than standing in for
+ *    them, as it prints their PIDs. If held is set, so does a counted
+ *    job, and its stages wait to exec (or run) until releasestages.
+ *    Returns how many processes started, or -1 if the pipeline is
+ *    malformed.
+ */
+int startstages(char **argv, struct proc_t *procs, int bg, int held) {
+    int nstages = countstages(argv), nprocs = 0, i;
+    int infd = -1, status;
+    pid_t pid, pgid = 0;
+    struct stage_t *stages;
+    const struct builtin_t **utils;
+
+    // A pipeline can be as long as its line, so these don't go on the stack
+    if (!(stages = malloc(nstages * sizeof(*stages))) ||
+        !(utils = malloc(nstages * sizeof(*utils))))
+        unix_error("malloc error");
+    if (splitstages(argv, stages) < 0){
+        free(stages);
+        free(utils);
+        return -1;
+    }
+    for (i = 0; i < nstages; i++)
+        utils[i] = findutil(stages[i].argv[0], !bg && !held);
 
-        // Close any opened file descriptors
-        if (infd > 0)
+    // Only a utility with no pipe to block on runs in the shell. Until
+    // this returns, the job isn't on the list and ctrl-c goes unheard
+    if (nstages == 1 && utils[0] && !bg && !held){
+        status = runlocal(utils[0], &stages[0], -1, -1);
+        localstatus = W_EXITCODE(status & 0xff, 0);
+        free(stages);
+        free(utils);
+        return 0;
+    }
+
+    // Anything we've printed has to come out before the job's output
+    fflush(stdout);
+    if (held)
+        holdstages();
+
+    // Start every stage in the process group of the first one, each
+    // reading from the pipe the previous stage writes to. Everything
+    // is close-on-exec; the children only keep their dup2s
+    for (i = 0; i < nstages; i++){
+        int pipe_fds[2] = {-1, -1};
+        // Out of fds (each stage running holds a pidfd), the stages
+        // started so far are the job; the last of them sees EPIPE
+        if (i < nstages - 1 && pipe2(pipe_fds, O_CLOEXEC) < 0){
+            printf("pipe: %s; stopped at stage %d of %d\n", strerror(errno), i + 1, nstages);
+            break;
+        }
+        if (utils[i])
+            pid = forklocal(utils[i], &stages[i], pgid, infd, pipe_fds[1]);
+        else
+            pid = launch(&stages[i], pgid, infd, pipe_fds[1]);
+        if (infd >= 0)
             close(infd);
-        if (outfd > 0)
-            close(outfd);
-        if (pipe_fds[0] > 0){
-            close(pipe_fds[0]);
+        if (pipe_fds[1] >= 0)
             close(pipe_fds[1]);
+        infd = pipe_fds[0];
+
+        if (pid > 0){
+            if (!pgid)
+                pgid = pid;
+            procs[nprocs].pid = pid;
+            procs[nprocs].pidfd = trackchild(pid);
+            procs[nprocs].local = utils[i] != NULL;
+            nprocs++;
         }
+    }
+    if (infd >= 0)
+        close(infd);
+    free(stages);
+    free(utils);
+    return nprocs;
+}
 
-        // Add the new job to the job pool
-        addjob(jobs, pid, (bg ? BG : FG) , cmdline);
-        // Unblock our child signal, so that we can reap our children
-        sigprocmask(SIG_UNBLOCK, &signal_set, NULL);
-        if (!bg){
-            // If we're a fg process, wait for it to complete
-            waitfg(pid);
-        } else
-            printf("[%d] (%d) %s", getjobpid(jobs, pid)->jid, pid, cmdline);
+/*
+ * startjob - Start a pending job in state (BG or FG) by running the line
+ *    it was queued with again. Returns 1 if it started; if not, it's
+ *    gone from the job list.
+ */
+int startjob(struct job_t *job, int state) {
+    char *line, **argv;
+    struct proc_t *procs;
+    int nprocs, timed, nice, perf;
+    long long start;
+
+    dequeuejob(jobs, job);
+    if (!(line = strdup(job->cmdline)))
+        unix_error("strdup error");
+    parseline(line, &argv);
+    nprocs = countstages(argv);
+    if (!(procs = malloc(nprocs * sizeof(*procs))))
+        unix_error("malloc error");
+
+    // Place it like any new BG job, unless it was pinned while it waited
+    if (state == BG && !job->cpus)
+        job->cpus = pickcpus(nprocs);
+    if (job->cpus)
+        bindshell(job->cpus);
+
+    // Skip time and nice, which have already been taken care of. It
+    // was typed with &, even if fg starts it
+    start = nsnow();
+    nprocs = startstages(argv + jobprefix(argv, &timed, &nice, &perf), procs, 1, job->perf != NULL);
+    if (job->cpus)
+        bindshell(NULL);
+    free(argv);
+    free(line);
+    if (nprocs <= 0){
+        releasestages();
+        free(procs);
+        removejob(jobs, job);
+        return 0;
     }
-    return;
+    attachprocs(jobs, job, procs, nprocs);
+    free(procs);
+    job->start = start;
+    if (job->perf)
+        perfjob(job, job->perf->report);
+    releasestages();
+    setjobstate(jobs, job, state);
+    schedjob(job);
+    return 1;
+}
+
+/*
+ * admitjobs - Start pending jobs in the background, in the order they
+ *    are queued in, while fewer than bglimit are running. Nothing is
+ *    started while the governor is holding jobs back.
+ */
+void admitjobs(void) {
+    struct job_t *job;
+
+    while ((job = jobs->pending) && (!bglimit || jobs->nbg < bglimit) && !nheld)
+        if (startjob(job, BG))
+            printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
 }
 
 /* 
  * parseline - Parse the command line and build the argv array.
  * 
- * Characters enclosed in single quotes are treated as a single
- * argument.  Return true if the user has requested a BG job, false if
- * the user has requested a FG job.  
- */
-int parseline(const char *cmdline, char **argv) {
-    static char array[MAXLINE]; /* holds local copy of command line */
-    char *buf = array;          /* ptr that traverses command line */
-    char *delim;                /* points to first space delimiter */
-    int argc;                   /* number of args */
+ * The line is tokenized in place: arguments are split on blanks, and
+ * quotes and backslashes are removed by sliding the rest of the
+ * argument down over them, so every argv entry points into cmdline.
+ * Inside '...' everything is literal. Inside "..." a backslash only
+ * escapes ", \, $ and `. Elsewhere it escapes blanks, quotes and
+ * itself, goes away with a newline after it (see continued), and is
+ * kept as is before anything else (so echo -e still sees \046).
+ * *argvp is set to a malloc'd, NULL terminated array that the caller
+ * frees. Return true if the user has requested a BG job, false if the
+ * user has requested a FG job.
+ */
+int parseline(char *cmdline, char ***argvp) {
+    struct scan_t sc;           /* finds the next special byte */
+    char *r = cmdline;          /* next byte not yet consumed */
+    char *w = NULL;             /* end of the current arg, NULL between args */
+    char *s, *q;                /* special bytes */
+    char **argv;                /* the argument list */
+    int argc = 0;               /* number of args */
+    int argcap = MAXARGS;       /* room in argv */
     int bg;                     /* background job? */
+    char c;
 
-    strcpy(buf, cmdline);
-    buf[strlen(buf)-1] = ' ';  /* replace trailing '\n' with space */
-    while (*buf && (*buf == ' ')) /* ignore leading spaces */
-	buf++;
+    if (!(argv = malloc(argcap * sizeof(*argv))))
+        unix_error("malloc error");
+    *argvp = argv;
 
-    /* Build the argv list */
-    argc = 0;
-    if (*buf == '\'') {
-        buf++;
-        delim = strchr(buf, '\'');
-    } else {
-        delim = strchr(buf, ' ');
-    }
+    scaninit(&sc, cmdline);
+    do {
+        s = scannext(&sc);
+        c = *s;
 
-    while (delim) {
-        argv[argc++] = buf;
-        *delim = '\0';
-        buf = delim + 1;
-        while (*buf && (*buf == ' ')) /* ignore spaces */
-           buf++;
+        // Anything but a blank (or a backslash joining lines) starts an
+        // argument if we're not in one already
+        if (!w && (s != r || !(c == ' ' || c == '\t' || c == '\n' || c == '\0' ||
+                               (c == '\\' && s[1] == '\n')))) {
+            if (argc + 2 > argcap){
+                argcap *= 2;
+                if (!(argv = realloc(argv, argcap * sizeof(*argv))))
+                    unix_error("realloc error");
+                *argvp = argv;
+            }
+            argv[argc++] = w = r;
+        }
 
-        if (*buf == '\'') {
-            buf++;
-            delim = strchr(buf, '\'');
-        } else {
-            delim = strchr(buf, ' ');
+        // The ordinary bytes before s belong to the current argument
+        if (w && w != r)
+            memmove(w, r, s - r);
+        if (w)
+            w += s - r;
+        r = s + 1;
+
+        switch (c) {
+        case '\'':
+            while (*(q = scannext(&sc)) && *q != '\'')
+                ;
+            if (!*q)
+                goto unterminated;
+            memmove(w, r, q - r);
+            w += q - r;
+            r = q + 1;
+            break;
+        case '"':
+            while (*(q = scannext(&sc)) && *q != '"') {
+                if (*q != '\\')
+                    continue;
+                memmove(w, r, q - r);
+                w += q - r;
+                r = q;
+                if (q[1] && strchr("\"\\$`", q[1])) {
+                    *w++ = q[1];
+                    if (q[1] == '"' || q[1] == '\\')
+                        scannext(&sc);
+                    r = q + 2;
+                }
+            }
+            if (!*q)
+                goto unterminated;
+            memmove(w, r, q - r);
+            w += q - r;
+            r = q + 1;
+            break;
+        case '\\':
+            if (s[1] == '\n') {    // joins lines, and is gone
+                scannext(&sc);
+                r = s + 2;
+                break;
+            }
+            if (s[1] && strchr(SCANSET, s[1])) {
+                *w++ = s[1];
+                scannext(&sc);
+                r = s + 2;
+            } else {
+                r = s;
+            }
+            break;
+        default:
+            // A blank, newline or the end of the line ends the argument
+            if (w) {
+                *w = '\0';
+                w = NULL;
+            }
         }
-    }
+    } while (c);
     argv[argc] = NULL;
     
     if (argc == 0)  /* ignore blank line */
@@ -345,133 +1210,2818 @@ int parseline(const char *cmdline, char **argv) {
         argv[--argc] = NULL;
     }
     return bg;
+
+ unterminated:
+    printf("Unterminated quote.\n");
+    argv[0] = NULL;
+    return 1;
 }
 
-/* 
- * builtin_cmd - If the user has typed a built-in command then execute
- *    it immediately.  
+/* scaninit - Start scanning the string p for bytes in SCANSET */
+void scaninit(struct scan_t *sc, char *p) {
+#ifdef SCANBLOCK
+    // Aligned loads never cross into the next page, so reading the rest
+    // of the block holding the NUL is safe
+    uintptr_t off = (uintptr_t)p & (SCANBLOCK - 1);
+
+    sc->block = p - off;
+    sc->mask = scanblock(sc->block) & ((uint32_t)-1 << off);
+#else
+    sc->block = p;
+#endif
+}
+
+/*
+ * scannext - Return the next byte in SCANSET, or the NUL ending the
+ *    string. Don't call it again after it returns the NUL.
  */
-int builtin_cmd(char **argv)  {
-    // Exit the shell
-    if (!strcmp(argv[0], "quit"))
-        exit(0);
-    // Eat solitary & commands
-    if (!strcmp(argv[0], "&"))
-        return 1;
-    // Display the jobs list
-    if (!strcmp(argv[0], "jobs")){
-        listjobs(jobs);
-        return 1;
-    }
-    // Bring stopped jobs into the foreground or background
-    if (!strcmp(argv[0], "fg") || !strcmp(argv[0], "bg")){
-        do_bgfg(argv);
-        return 1;
-    }
-    // Kill stopped or background jobs
-    if (!strcmp(argv[0], "kill")){
-        if (!argv[1] || strlen(argv[1]) == 0){
-            printf("%s command requires PID or %%jobid argument.\n", argv[0]);
-            return 1;
-        }
-        // Interpret a prepended % as a job id
-        char *startptr = (*(argv[1]) == '%') ? argv[1] + 1 : argv[1];
-        char *endptr = NULL;
-        errno = 0;
-        int id = strtol(startptr, &endptr, 10);
-        if (endptr == startptr
-                || '\0' != *endptr
-                || ((LONG_MIN == id || LONG_MAX == id) && ERANGE == errno)
-                || id > INT_MAX
-                || id < INT_MIN ) {
-            printf("%s: argument must be a PID or %%jobid\n", argv[0]);
-            return 1;
-        }
-        struct job_t *job;
-
-        if ((*(argv[1]) == '%') && !(job = getjobjid(jobs, id))){
-            printf("%s: No such job\n", argv[1]);
-            return 1;
-        } else if (!(job = getjobpid(jobs, id))){
-            printf("(%d): No such process\n", id);
-            return 1;
-        }
-        kill(-job->pid, SIGKILL);
-        return 1;
+char *scannext(struct scan_t *sc) {
+#ifdef SCANBLOCK
+    int i;
+
+    while (!sc->mask) {
+        sc->block += SCANBLOCK;
+        sc->mask = scanblock(sc->block);
     }
-    return 0;     /* not a builtin command */
+    i = __builtin_ctz(sc->mask);
+    sc->mask &= sc->mask - 1;
+    return sc->block + i;
+#else
+    char *p = sc->block + strcspn(sc->block, SCANSET);
+
+    sc->block = p + 1;
+    return p;
+#endif
 }
 
-/* 
- * do_bgfg - Execute the builtin bg and fg commands
+#ifdef SCANBLOCK
+/* scanblock - Return a bit mask of the bytes in SCANSET or NUL in block */
+uint32_t scanblock(const char *block) {
+    scanvec_t v = scanload(block);
+    scanvec_t hit = scaneq(v, scansplat(0));
+    const char *c;
+
+    for (c = SCANSET; *c; c++)
+        hit = scanor(hit, scaneq(v, scansplat(*c)));
+    return scanmask(hit);
+}
+#endif
+
+/*
+ * runlines - Evaluate each line of the len bytes at buf, in order. The
+ *    lines are split and tokenized where they lie, so buf must have 2
+ *    writable bytes past the end.
  */
-void do_bgfg(char **argv)  {
-    // Extra error checking can't hurt, though this should be impossible
-    if (fgpid(jobs) != 0){
-        printf("Foreground process detected.\n");
-        return;
-    }
-    // If there was no supplied argument, run away
-    if (!argv[1]){
-        printf("%s command requires PID or %%jobid argument\n", argv[0]);
-        return;
-    }
-    // Interpret a prepended % as a job id
-    char *startptr = (*(argv[1]) == '%') ? argv[1] + 1 : argv[1];
-    char *endptr = NULL;
-    errno = 0;
-    int id = strtol(startptr, &endptr, 10);
-    if (endptr == startptr
-            || '\0' != *endptr
-            || ((LONG_MIN == id || LONG_MAX == id) && ERANGE == errno)
-            || id > INT_MAX
-            || id < INT_MIN ) {
-        printf("%s: argument must be a PID or %%jobid\n", argv[0]);
-        return;
-    }
+void runlines(char *buf, size_t len) {
+    char *line, *next, save;
 
-    struct job_t *job = (*(argv[1]) == '%') ? getjobjid(jobs, id) : getjobpid(jobs, id);
-    if (!job){
-        if ((*(argv[1]) == '%')){
-            printf("%s: No such job\n", argv[1]);
-        } else {
-            printf("(%d): No such process\n", id);
-        }
-        return;
-    }
+    if (len > 0 && buf[len-1] != '\n')
+        buf[len++] = '\n';
+    buf[len] = '\0';
 
-    if (!strcmp(argv[0], "fg")){
-        // Resume a stopped process in the fg
-        if (job->state == ST){
-            kill(-job->pid, SIGCONT);
+    for (line = buf; line < buf + len; line = next) {
+        // NUL terminate the line (keeping its newline, which job
+        // listings print) in the first byte of the next one for now.
+        // One ending in a backslash goes on into the next
+        next = line;
+        do
+            next = (char *)memchr(next, '\n', buf + len - next) + 1;
+        while (next < buf + len && continued(line, next - line));
+        save = *next;
+        *next = '\0';
+        if (fgreaped) {
+            latrecord(LAT_PROMPT, nsnow() - fgreaped);
+            fgreaped = 0;
         }
-        job->state = FG;
-        waitfg(job->pid);
-    } else {
-        // Resume a stopped process in the bg
-        if (job->state == ST){
-            kill(-job->pid, SIGCONT);
-        }
-        job->state = BG;
+        if (*line != '#')
+            eval(line);
+        *next = save;
+
+        // Nothing else will wait for events while lines are left
+        dispatch_events(0);
+        drainnotes();
     }
-    return;
+    fflush(stdout);
 }
 
-/* 
- * waitfg - Block until process pid is no longer the foreground process
+/*
+ * runscript - Run the commands in the file path. Regular files are
+ *    mapped copy-on-write and run where they lie; anything else is
+ *    read in blocks of BATCHBUF.
  */
-void waitfg(pid_t pid) {
-    struct job_t *job = getjobpid(jobs, pid);
+void runscript(const char *path) {
+    struct stat st;
+    char *buf = NULL;
+    size_t len = 0;
+    long pagesize = sysconf(_SC_PAGESIZE);
+    int fd;
 
-    // While there's a foreground job...
-    while (job && job->state == FG){
-        sleep(1); // zzzzzzzzz...
-        job = getjobpid(jobs, pid);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        unix_error((char *)path);
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        // Map the file over a reservation a page longer, so the bytes
+        // runlines wants past the end are there (and zero)
+        len = st.st_size;
+        buf = mmap(NULL, len + pagesize, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf == MAP_FAILED ||
+            mmap(buf, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+            unix_error("mmap error");
+        madvise(buf, len, MADV_SEQUENTIAL);
+    } else {
+        buf = readfd(fd, &len);
     }
+    close(fd);
+    runlines(buf, len);
 }
 
-/*****************
- * Signal handlers
+/*
+ * readfd - Read everything left in fd, in blocks of BATCHBUF, into a
+ *    malloc'd buffer with 2 spare bytes past the *lenp it reads
+ */
+char *readfd(int fd, size_t *lenp) {
+    char *buf = NULL;
+    size_t len = 0, cap = 0;
+    ssize_t n;
+
+    do {
+        if (len + BATCHBUF + 2 > cap) {
+            cap = cap ? 2 * cap : 2 * BATCHBUF;
+            if (!(buf = realloc(buf, cap)))
+                unix_error("realloc error");
+        }
+        if ((n = read(fd, buf + len, BATCHBUF)) < 0 && errno != EINTR)
+            unix_error("read error");
+        if (n > 0)
+            len += n;
+    } while (n != 0);
+    *lenp = len;
+    return buf;
+}
+
+/*
+ * splitstages - Split argv in place into the stages of a pipeline,
+ *    taking the < and > redirections out of each stage's arguments.
+ *    stages needs room for one entry per |. Returns the number of
+ *    stages, or -1 (after complaining) if the pipeline is malformed.
+ */
+int splitstages(char **argv, struct stage_t *stages) {
+    struct stage_t *stage = stages;
+    char **arg, **out = argv;
+
+    stage->argv = out;
+    stage->infile = stage->outfile = NULL;
+    for (arg = argv; *arg; arg++){
+        if (!strcmp(*arg, "<") || !strcmp(*arg, ">")){
+            if (!arg[1] || !strcmp(arg[1], "|")){
+                printf("Missing name for redirect.\n");
+                return -1;
+            }
+            if (**arg == '<')
+                stage->infile = arg[1];
+            else
+                stage->outfile = arg[1];
+            arg++;
+        } else if (!strcmp(*arg, "|")){
+            if (out == stage->argv){
+                printf("Invalid null command.\n");
+                return -1;
+            }
+            *out++ = NULL;
+            stage++;
+            stage->argv = out;
+            stage->infile = stage->outfile = NULL;
+        } else {
+            *out++ = *arg;
+        }
+    }
+    *out = NULL;
+    if (out == stage->argv){
+        printf("Invalid null command.\n");
+        return -1;
+    }
+    return stage - stages + 1;
+}
+
+/* 
+ * builtin_cmd - If the user has typed a built-in command then execute
+ *    it immediately. bg and cmdline are for builtins that start jobs.
+ */
+int builtin_cmd(char **argv, int bg, char *cmdline)  {
+    const struct builtin_t *b = findbuiltin(argv[0]);
+
+    if (!b || !b->cmd)
+        return 0;     /* not a builtin command */
+    TRACE(b->name, 'B', 0, 0);
+    b->cmd(argv, bg, cmdline);
+    TRACE(b->name, 'E', 0, 0);
+    return 1;
+}
+
+/* do_quit - Exit the shell */
+void do_quit(char **argv, int bg, char *cmdline) {
+    exit(0);
+}
+
+/* do_nothing - Eat solitary & commands */
+void do_nothing(char **argv, int bg, char *cmdline) {
+}
+
+/*
+ * do_jobs - jobs [-m | -l | -p]: list the jobs, or how the job table
+ *    uses memory (-m), or what each job has used (-l), or what the perf
+ *    counters of the counted ones say (-p)
+ */
+void do_jobs(char **argv, int bg, char *cmdline) {
+    if (argv[1] && !strcmp(argv[1], "-m"))
+        memjobs(jobs, cmdline);
+    else if (argv[1] && !strcmp(argv[1], "-l"))
+        listusage(jobs);
+    else if (argv[1] && !strcmp(argv[1], "-p"))
+        perfjobs(jobs);
+    else
+        listjobs(jobs);
+}
+
+/*
+ * do_kill - Kill stopped or background jobs
+ */
+void do_kill(char **argv, int bg, char *cmdline) {
+    if (!argv[1] || strlen(argv[1]) == 0){
+        printf("%s command requires PID or %%jobid argument.\n", argv[0]);
+        return;
+    }
+    // Interpret a prepended % as a job id
+    char *startptr = (*(argv[1]) == '%') ? argv[1] + 1 : argv[1];
+    char *endptr = NULL;
+    errno = 0;
+    long id = strtol(startptr, &endptr, 10);
+    if (endptr == startptr
+            || '\0' != *endptr
+            || ((LONG_MIN == id || LONG_MAX == id) && ERANGE == errno)
+            || id > INT_MAX
+            || id < INT_MIN ) {
+        printf("%s: argument must be a PID or %%jobid\n", argv[0]);
+        return;
+    }
+    struct job_t *job;
+
+    if (*(argv[1]) == '%'){
+        if (!(job = getjobjid(jobs, id))){
+            printf("%s: No such job\n", argv[1]);
+            return;
+        }
+    } else if (!(job = getjobpid(jobs, id))){
+        printf("(%ld): No such process\n", id);
+        return;
+    }
+    // A pending job has nothing to kill yet; it just never starts
+    if (job->state == PD){
+        printf("Job [%d] cancelled\n", job->jid);
+        removejob(jobs, job);
+        return;
+    }
+    signaljob(job, SIGKILL);
+    if (job->queue)
+        runqueue(job);
+}
+
+/* 
+ * do_bgfg - Execute the builtin bg and fg commands
+ */
+void do_bgfg(char **argv, int bg, char *cmdline)  {
+    // Extra error checking can't hurt, though this should be impossible
+    if (fgpid(jobs) != 0){
+        printf("Foreground process detected.\n");
+        return;
+    }
+    // If there was no supplied argument, run away
+    if (!argv[1]){
+        printf("%s command requires PID or %%jobid argument\n", argv[0]);
+        return;
+    }
+    // Interpret a prepended % as a job id
+    char *startptr = (*(argv[1]) == '%') ? argv[1] + 1 : argv[1];
+    char *endptr = NULL;
+    errno = 0;
+    long id = strtol(startptr, &endptr, 10);
+    if (endptr == startptr
+            || '\0' != *endptr
+            || ((LONG_MIN == id || LONG_MAX == id) && ERANGE == errno)
+            || id > INT_MAX
+            || id < INT_MIN ) {
+        printf("%s: argument must be a PID or %%jobid\n", argv[0]);
+        return;
+    }
+
+    struct job_t *job = (*(argv[1]) == '%') ? getjobjid(jobs, id) : getjobpid(jobs, id);
+    if (!job){
+        if ((*(argv[1]) == '%')){
+            printf("%s: No such job\n", argv[1]);
+        } else {
+            printf("(%ld): No such process\n", id);
+        }
+        return;
+    }
+
+    TRACE(argv[0][0] == 'f' ? "fg" : "bg", 'i', job->jid, job->pid);
+    if (!strcmp(argv[0], "fg")){
+        // Start a pending job now, or resume a stopped one, in the fg
+        if (job->state == PD){
+            if (startjob(job, FG))
+                waitfg(job->pid);
+            return;
+        }
+        if (job->state == ST){
+            TRACE("continue", 'i', job->jid, job->pid);
+            signaljob(job, SIGCONT);
+        }
+        holdjob(job, 0);
+        setjobstate(jobs, job, FG);
+        placejob(job);
+        schedjob(job);
+        // It no longer counts against bglimit
+        admitjobs();
+        if (!job->queue || !runqueue(job))
+            waitfg(job->pid);
+    } else {
+        // Start a pending job now, past bglimit if need be
+        if (job->state == PD){
+            if (startjob(job, BG))
+                printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
+            return;
+        }
+        // Resume a stopped process in the bg
+        if (job->state == ST){
+            TRACE("continue", 'i', job->jid, job->pid);
+            signaljob(job, SIGCONT);
+        }
+        holdjob(job, 0);
+        setjobstate(jobs, job, BG);
+        placejob(job);
+        schedjob(job);
+        if (job->queue)
+            runqueue(job);
+    }
+    return;
+}
+
+/* 
+ * do_hash - Execute the builtin hash command: list the remembered
+ *    command locations, forget them all (-r) or look up the given names
+ */
+void do_hash(char **argv, int bg, char *cmdline) {
+    char **arg;
+
+    if (!argv[1]){
+        listhash();
+        return;
+    }
+    if (!strcmp(argv[1], "-r")){
+        clearhash();
+        return;
+    }
+    for (arg = argv + 1; *arg; arg++)
+        if (!findcmd(*arg))
+            printf("%s: %s: not found\n", argv[0], *arg);
+}
+
+/*
+ * do_bglimit - Execute the builtin bglimit command:
+ *
+ *    bglimit [N]             show the limit, or set it (0 for none)
+ *    bglimit -p %jid prio    move a pending job in the queue
+ *
+ * Background jobs over the limit wait in the PD state and start, lowest
+ * prio first and in order of arrival among equals, as others finish.
+ */
+void do_bglimit(char **argv, int bg, char *cmdline) {
+    struct job_t *job;
+    char *end;
+    long n;
+
+    if (!argv[1]){
+        if (bglimit)
+            printf("bglimit: %d", bglimit);
+        else
+            printf("bglimit: none");
+        for (n = 0, job = jobs->pending; job; job = job->next)
+            n++;
+        printf(" (%d running, %ld pending)\n", jobs->nbg, n);
+        return;
+    }
+    if (!strcmp(argv[1], "-p")){
+        if (!argv[2] || *argv[2] != '%' || !argv[3]){
+            printf("usage: %s -p %%jobid prio\n", argv[0]);
+            return;
+        }
+        if (!(job = getjobjid(jobs, atoi(argv[2] + 1)))){
+            printf("%s: No such job\n", argv[2]);
+            return;
+        }
+        n = strtol(argv[3], &end, 10);
+        if (end == argv[3] || *end){
+            printf("%s: prio must be a number\n", argv[0]);
+            return;
+        }
+        job->prio = n;
+        if (job->state == PD){
+            dequeuejob(jobs, job);
+            queuejob(jobs, job);
+        }
+        return;
+    }
+    n = strtol(argv[1], &end, 10);
+    if (end == argv[1] || *end || n < 0 || n > INT_MAX){
+        printf("usage: %s [N | -p %%jobid prio]\n", argv[0]);
+        return;
+    }
+    bglimit = n;
+    admitjobs();
+}
+
+/*
+ * do_pin - Execute the builtin pin command:
+ *
+ *    pin                   show the FG CPU and where each job is pinned
+ *    pin -f cpu|none       keep cpu free of BG jobs for FG ones
+ *    pin %jid cpus|none    pin a job by hand (to CPUs like 0-3,6)
+ *
+ * A job pinned by hand stays where it was put; otherwise BG jobs are
+ * placed when they start or are moved to the BG, and FG jobs get every
+ * CPU the shell has.
+ */
+void do_pin(char **argv, int bg, char *cmdline) {
+    struct job_t *job;
+    cpu_set_t set, *cpus;
+    char buf[256];
+    int i;
+
+    if (!argv[1]){
+        if (fgcpu >= 0)
+            printf("pin: FG cpu %d of %s\n", fgcpu, formatcpus(&shellcpus, buf, sizeof(buf)));
+        else
+            printf("pin: FG cpu none of %s\n", formatcpus(&shellcpus, buf, sizeof(buf)));
+        for (i = 1; i <= jobs->maxjid; i++)
+            if ((job = jobs->byjid[i]) && job->cpus)
+                printf("[%d] (%d) cpus %s%s\n", job->jid, job->pid,
+                       formatcpus(job->cpus, buf, sizeof(buf)),
+                       job->pinned ? " (by hand)" : "");
+        return;
+    }
+    if (!strcmp(argv[1], "-f")){
+        if (argv[2] && !strcmp(argv[2], "none"))
+            fgcpu = -1;
+        else if (argv[2] && parsecpus(argv[2], &set) == 0 && CPU_COUNT(&set) == 1 &&
+                 CPU_ISSET(i = atoi(argv[2]), &shellcpus))
+            fgcpu = i;
+        else {
+            printf("usage: %s -f cpu|none (cpu is one of %s)\n", argv[0],
+                   formatcpus(&shellcpus, buf, sizeof(buf)));
+            return;
+        }
+        // Move the BG jobs already placed off the CPU, or onto it
+        for (i = 1; i <= jobs->maxjid; i++)
+            if ((job = jobs->byjid[i]) && job->state == BG && !job->pinned && !job->queue){
+                pinjob(job, NULL);
+                placejob(job);
+            }
+        return;
+    }
+    if (*argv[1] != '%' || !argv[2]){
+        printf("usage: %s [-f cpu|none | %%jobid cpus|none]\n", argv[0]);
+        return;
+    }
+    if (!(job = getjobjid(jobs, atoi(argv[1] + 1)))){
+        printf("%s: No such job\n", argv[1]);
+        return;
+    }
+
+    // none hands the job back to automatic placement
+    if (!strcmp(argv[2], "none")){
+        job->pinned = 0;
+        pinjob(job, NULL);
+        placejob(job);
+        return;
+    }
+    if (parsecpus(argv[2], &set) < 0){
+        printf("%s: %s: bad CPU list\n", argv[0], argv[2]);
+        return;
+    }
+    CPU_AND(&set, &set, &shellcpus);
+    if (CPU_COUNT(&set) == 0){
+        printf("%s: %s: no usable CPUs (have %s)\n", argv[0], argv[2],
+               formatcpus(&shellcpus, buf, sizeof(buf)));
+        return;
+    }
+    if (!(cpus = malloc(sizeof(*cpus))))
+        unix_error("malloc error");
+    *cpus = set;
+    job->pinned = 1;
+    pinjob(job, cpus);
+}
+
+/*
+ * do_renice - Execute the builtin renice command:
+ *
+ *    renice [-n] N %jid...
+ *
+ * sets the nice level of every process in each job. A pending job gets
+ * it when it starts, and moves to its place in the queue for N.
+ */
+void do_renice(char **argv, int bg, char *cmdline) {
+    struct job_t *job;
+    char **arg = argv + 1, *end;
+    long n;
+
+    if (*arg && !strcmp(*arg, "-n"))
+        arg++;
+    if (!*arg || !arg[1] || (n = strtol(*arg, &end, 10), end == *arg || *end)){
+        printf("usage: %s [-n] N %%jobid...\n", argv[0]);
+        return;
+    }
+    n = n < -20 ? -20 : n > 19 ? 19 : n;
+    for (arg++; *arg; arg++){
+        if (**arg != '%' || !(job = getjobjid(jobs, atoi(*arg + 1)))){
+            printf("%s: No such job\n", *arg);
+            continue;
+        }
+        if (job->state == PD){
+            dequeuejob(jobs, job);
+            job->prio = n;
+            queuejob(jobs, job);
+        } else if (job->nlive && setpriority(PRIO_PGRP, job->pid, n) < 0){
+            printf("%s: %s: %s\n", argv[0], *arg, strerror(errno));
+            continue;
+        }
+        job->nice = n;
+    }
+}
+
+/*
+ * do_governor - Execute the builtin governor command:
+ *
+ *    governor                          show its settings and decisions
+ *    governor on [memory=N] [cpu=N] [io=N]
+ *    governor off
+ *
+ * While it's on, a resource whose PSI "some" stall time goes over N% of
+ * the time (0 to not watch it) gets BG jobs stopped one at a time, and
+ * they're continued once pressure is back under half of that.
+ */
+void do_governor(char **argv, int bg, char *cmdline) {
+    char **arg, *eq;
+    int i, n;
+
+    if (!argv[1]){
+        printf("governor: %s, holding %d jobs\n", governing ? "on" : "off", nheld);
+        for (i = 0; i < NPSI; i++)
+            printf("    %-6s limit %d%%, some avg10 %.2f%%\n", psi[i].name,
+                   psi[i].limit, psiavg(&psi[i]));
+        for (i = ngovlog > GOVLOG ? ngovlog - GOVLOG : 0; i < ngovlog; i++)
+            printf("    %s\n", govlog[i % GOVLOG]);
+        return;
+    }
+    if (!strcmp(argv[1], "off")){
+        stopgovernor();
+        return;
+    }
+    if (strcmp(argv[1], "on")){
+        printf("usage: %s [on [memory=N] [cpu=N] [io=N] | off]\n", argv[0]);
+        return;
+    }
+    for (arg = argv + 2; *arg; arg++){
+        for (i = 0; i < NPSI; i++)
+            if ((eq = strchr(*arg, '=')) && (size_t)(eq - *arg) == strlen(psi[i].name) &&
+                !strncmp(*arg, psi[i].name, eq - *arg))
+                break;
+        if (i == NPSI || (n = atoi(eq + 1)) < 0 || n > 100){
+            printf("%s: %s: expected memory=N, cpu=N or io=N (N%% from 0 to 100)\n",
+                   argv[0], *arg);
+            return;
+        }
+        psi[i].limit = n;
+    }
+    if (startgovernor() < 0)
+        printf("%s: can't watch /proc/pressure: %s\n", argv[0], strerror(errno));
+}
+
+/*
+ * do_parallel - Execute the builtin parallel command:
+ *
+ *    parallel [-j N] -a file command [args...]
+ *    parallel [-j N] command [args...] ::: item...
+ *
+ * runs command once per line of file (- for stdin, unless that's where
+ * the shell reads its commands) or once per item, with {} in its args
+ * replaced by the line, or the line appended if there's no {}. At most
+ * N (by default, the number of online CPUs) run at once. It's all one
+ * job: each exit starts the next item from the reap path, and stopping
+ * the job holds the queue until it's continued.
+ */
+void do_parallel(char **argv, int bg, char *cmdline) {
+    struct queue_t *queue;
+    struct proc_t *procs;
+    struct job_t *job;
+    char **arg, **items = NULL, *file = NULL, *line = NULL, *p;
+    size_t len = 0, cap = 0, size;
+    long slots = sysconf(_SC_NPROCESSORS_ONLN);
+    int i, n, fd;
+    pid_t pid = 0;
+
+    for (arg = argv + 1; *arg && **arg == '-'; arg++) {
+        if (!strcmp(*arg, "-j") && arg[1] && (slots = atoi(arg[1])) > 0)
+            arg++;
+        else if (!strcmp(*arg, "-a") && arg[1])
+            file = *++arg;
+        else
+            break;
+    }
+    for (n = 0; arg[n] && strcmp(arg[n], ":::"); n++)
+        ;
+    if (arg[n])
+        items = arg + n + 1;
+    if (!*arg || **arg == '-' || n == 0 || !file == !items) {
+        printf("usage: %s [-j N] -a file command [args...]\n"
+               "       %s [-j N] command [args...] ::: item...\n", argv[0], argv[0]);
+        return;
+    }
+    // Without a script or -c, stdin holds the lines still to be typed
+    if (file && !strcmp(file, "-") && !batch) {
+        printf("%s: -a -: stdin is the shell's input\n", argv[0]);
+        return;
+    }
+
+    // Keep a copy of the template; argv goes away when we return
+    for (i = 0, size = 0; i < n; i++)
+        size += strlen(arg[i]) + 1;
+    if (!(queue = calloc(1, sizeof(*queue))) ||
+        !(queue->tmpl = malloc((n + 1) * sizeof(char *) + size)))
+        unix_error("malloc error");
+    p = (char *)(queue->tmpl + n + 1);
+    for (i = 0; i < n; i++) {
+        queue->tmpl[i] = strcpy(p, arg[i]);
+        p += strlen(p) + 1;
+        if (strstr(arg[i], "{}"))
+            queue->subst = 1;
+    }
+    queue->tmpl[n] = NULL;
+
+    // Read every item up front, one per line
+    if (items) {
+        for (arg = items; *arg; arg++) {
+            size = strlen(*arg);
+            if (len + size + 1 > cap) {
+                cap = 2 * (len + size + 1);
+                if (!(queue->buf = realloc(queue->buf, cap)))
+                    unix_error("realloc error");
+            }
+            memcpy(queue->buf + len, *arg, size);
+            len += size;
+            queue->buf[len++] = '\n';
+        }
+    } else if (!strcmp(file, "-")) {
+        queue->buf = readfd(STDIN_FILENO, &len);
+    } else {
+        if ((fd = open(file, O_RDONLY | O_CLOEXEC)) < 0) {
+            printf("%s: %s: %s\n", argv[0], file, strerror(errno));
+            free(queue->tmpl);
+            free(queue);
+            return;
+        }
+        queue->buf = readfd(fd, &len);
+        close(fd);
+    }
+    for (p = queue->buf, i = 0; p && p < queue->buf + len; p = line + 1) {
+        if (!(line = memchr(p, '\n', queue->buf + len - p)))
+            line = queue->buf + len;
+        *line = '\0';
+        if (*p == '\0')
+            continue;
+        if (queue->nitems == i) {
+            i = i ? 2 * i : 64;
+            if (!(queue->items = realloc(queue->items, i * sizeof(char *))))
+                unix_error("realloc error");
+        }
+        queue->items[queue->nitems++] = p;
+    }
+
+    // Start the first item that will start; the rest are started by
+    // runqueue once the job exists
+    if (slots > queue->nitems)
+        slots = queue->nitems;
+    while (queue->next < queue->nitems &&
+           (pid = startitem(queue, queue->items[queue->next++], 0)) < 0) {
+        queue->done++;
+        queue->failed++;
+    }
+
+    if (pid <= 0) {
+        printf("parallel: %d items, %d failed\n", queue->done, queue->failed);
+        free(queue->tmpl);
+        free(queue->items);
+        free(queue->buf);
+        free(queue);
+        return;
+    }
+
+    if (!(procs = calloc(slots, sizeof(*procs))))
+        unix_error("calloc error");
+    procs[0].pid = pid;
+    procs[0].pidfd = trackchild(pid);
+    addjob(jobs, procs, slots, (bg ? BG : FG), cmdline);
+    free(procs);
+    job = getjobpid(jobs, pid);
+    job->queue = queue;
+    pid = job->pid;
+    if (runqueue(job))
+        return;
+    if (!bg)
+        waitfg(pid);
+    else
+        printf("[%d] (%d) %s", job->jid, job->pid, cmdline);
+}
+
+/*
+ * runqueue - Start queued items of a parallel job in its free slots,
+ *    unless it's stopped or cancelled. If it has run out of work, report
+ *    how it went and delete it, and return 1.
+ */
+int runqueue(struct job_t *job) {
+    struct queue_t *queue = job->queue;
+    long long ns;
+    pid_t pid;
+    int i, started = 0;
+
+    // Items of a job pinned by hand start out on its CPUs
+    if (job->cpus)
+        bindshell(job->cpus);
+    for (i = 0; i < job->nprocs && job->state != ST && !queue->cancelled; i++) {
+        if (job->procs[i].pid)
+            continue;
+        for (pid = -1; pid < 0 && queue->next < queue->nitems; ) {
+            // Join the job's process group if it still has anyone in it
+            if ((pid = startitem(queue, queue->items[queue->next++],
+                                 job->nlive ? job->pid : 0)) < 0) {
+                queue->done++;
+                queue->failed++;
+            }
+        }
+        if (pid < 0)
+            break;
+
+        // The first member of a new group is its leader, and the job's PID
+        if (!job->nlive) {
+            unindexpid(jobs, job->pid);
+            job->pid = pid;
+        }
+        job->procs[i].pid = pid;
+        job->procs[i].pidfd = trackchild(pid);
+        indexpid(jobs, pid, job);
+        job->nlive++;
+        started++;
+    }
+    if (job->cpus)
+        bindshell(NULL);
+    if (started)
+        publishjob(job);
+    // New items start out with the shell's priority
+    if (started && (job->state != FG || job->nice))
+        schedjob(job);
+
+    if (job->nlive || (queue->next < queue->nitems && !queue->cancelled))
+        return 0;
+    ns = nsnow() - job->start;
+    printf("Job [%d] parallel: %d of %d items in %lld.%03llds (%.1f/s), %d failed\n",
+           job->jid, queue->done, queue->nitems, ns / 1000000000, ns / 1000000 % 1000,
+           ns ? queue->done * 1e9 / ns : 0.0, queue->failed);
+    removejob(jobs, job);
+    return 1;
+}
+
+/*
+ * startitem - Start the queue's template on item in process group pgid
+ *    (0 for a new group). Returns its PID, or -1 if it couldn't start.
+ */
+pid_t startitem(struct queue_t *queue, char *item, pid_t pgid) {
+    struct stage_t stage = {NULL, NULL, NULL};
+    char **argv, **tmpl, **arg, *p, *q, *s;
+    size_t len = strlen(item);
+    int n, nsubst;
+    pid_t pid;
+
+    for (n = 0; queue->tmpl[n]; n++)
+        ;
+    if (!(argv = malloc((n + 2) * sizeof(*argv))))
+        unix_error("malloc error");
+    for (tmpl = queue->tmpl, arg = argv; *tmpl; tmpl++, arg++) {
+        // Copy any argument with {} in it, putting the item in place of each
+        for (nsubst = 0, p = *tmpl; (p = strstr(p, "{}")); p += 2)
+            nsubst++;
+        if (!nsubst) {
+            *arg = *tmpl;
+            continue;
+        }
+        if (!(*arg = s = malloc(strlen(*tmpl) + nsubst * len + 1)))
+            unix_error("malloc error");
+        for (p = *tmpl; (q = strstr(p, "{}")); p = q + 2) {
+            memcpy(s, p, q - p);
+            s += q - p;
+            memcpy(s, item, len);
+            s += len;
+        }
+        strcpy(s, p);
+    }
+    if (!queue->subst)
+        *arg++ = item;
+    *arg = NULL;
+
+    stage.argv = argv;
+    pid = launch(&stage, pgid, -1, -1);
+
+    for (tmpl = queue->tmpl, arg = argv; *tmpl; tmpl++, arg++)
+        if (*arg != *tmpl)
+            free(*arg);
+    free(argv);
+    return pid;
+}
+
+/* 
+ * waitfg - Block until process pid is no longer the foreground process
+ */
+void waitfg(pid_t pid) {
+    struct job_t *job = getjobpid(jobs, pid);
+
+    // While there's a foreground job, sleep until the next job event.
+    // A parallel job can change its PID, so hold on to the job itself
+    if (job)
+        TRACE("wait", 'B', job->jid, job->pid);
+    while (job && jobs->fg == job)
+        dispatch_events(-1);
+    TRACE("wait", 'E', 0, 0);
+    drainnotes();
+}
+
+/*****************
+ * Builtin commands
+ *
+ * Every command the shell runs itself is found through one hash table,
+ * so looking a name up costs the same however many there are. Some run
+ * on the whole line (cmd), like fg or jobs; the rest run as pipeline
+ * stages (fn), which is also what plugins loaded with enable -f provide.
+ *****************/
+
+struct builtin_t stdbuiltins[] = {
+    { .name = "quit", .cmd = do_quit },
+    { .name = "&", .cmd = do_nothing },
+    { .name = "jobs", .cmd = do_jobs },
+    { .name = "hash", .cmd = do_hash },
+    { .name = "parallel", .cmd = do_parallel },
+    { .name = "pin", .cmd = do_pin },
+    { .name = "governor", .cmd = do_governor },
+    { .name = "renice", .cmd = do_renice },
+    { .name = "bglimit", .cmd = do_bglimit },
+    { .name = "fg", .cmd = do_bgfg },
+    { .name = "bg", .cmd = do_bgfg },
+    { .name = "kill", .cmd = do_kill },
+    { .name = "enable", .cmd = do_enable },
+    { .name = "history", .cmd = do_history },
+    { .name = "trace", .cmd = do_trace },
+    { .name = "stats", .cmd = do_stats },
+    { .name = "perfstat", .cmd = do_perfstat },
+    { .name = "jtop", .cmd = do_jtop },
+    { .name = "echo", .fn = do_echo, .standin = 1 },
+    { .name = "printf", .fn = do_printf, .standin = 1 },
+    { .name = "test", .fn = do_test, .standin = 1 },
+    { .name = "[", .fn = do_test, .standin = 1 },
+    { .name = "true", .fn = do_true, .standin = 1 },
+    { .name = "false", .fn = do_false, .standin = 1 },
+    { .name = NULL }
+};
+
+/* initbuiltins - Fill the builtin table with the shell's own commands */
+void initbuiltins(void) {
+    struct builtin_t *b;
+
+    for (b = stdbuiltins; b->name; b++)
+        addbuiltin(b);
+}
+
+/* builtinhash - The bucket of the builtin table name belongs in */
+unsigned builtinhash(const char *name) {
+    unsigned h = 5381;
+
+    for (; *name; name++)
+        h = h * 33 + (unsigned char)*name;
+    return h & (BUILTINHASH - 1);
+}
+
+/*
+ * findbuiltin - Return the builtin called name, or NULL. The one added
+ *    last wins, so a plugin can stand in for a command of the shell's.
+ */
+const struct builtin_t *findbuiltin(const char *name) {
+    const struct builtin_t *b;
+
+    for (b = builtins[builtinhash(name)]; b; b = b->next)
+        if (!strcmp(b->name, name))
+            return b;
+    return NULL;
+}
+
+/* addbuiltin - Put b in the builtin table, in front of any namesake */
+void addbuiltin(struct builtin_t *b) {
+    unsigned h = builtinhash(b->name);
+
+    b->next = builtins[h];
+    builtins[h] = b;
+}
+
+/*
+ * findutil - Return the builtin that runs the pipeline stage command
+ *    name in the shell, or NULL if it has to be exec'd. If standin is
+ *    set, /bin/echo and /usr/bin/echo are echo too, which is what the
+ *    traces use.
+ */
+const struct builtin_t *findutil(const char *name, int standin) {
+    const struct builtin_t *b;
+
+    if ((b = findbuiltin(name)))
+        return b->fn ? b : NULL;
+    if (!standin)
+        return NULL;
+    if (!strncmp(name, "/bin/", 5))
+        name += 5;
+    else if (!strncmp(name, "/usr/bin/", 9))
+        name += 9;
+    else
+        return NULL;
+    if ((b = findbuiltin(name)) && b->fn && b->standin)
+        return b;
+    return NULL;
+}
+
+/*
+ * do_enable - enable [-f lib.so [name...] | -d name...]: list the
+ *    builtins, load the named commands (all of them, if none are named)
+ *    from a plugin, or drop commands a plugin added
+ */
+void do_enable(char **argv, int bg, char *cmdline) {
+    struct builtin_t **bp, *b;
+    const struct builtin_t **list;
+    char **name;
+    int i, n = 0;
+
+    if (!argv[1]){
+        for (i = 0; i < BUILTINHASH; i++)
+            for (b = builtins[i]; b; b = b->next)
+                n++;
+        if (!(list = malloc(n * sizeof(*list))))
+            unix_error("malloc error");
+        for (n = i = 0; i < BUILTINHASH; i++)
+            for (b = builtins[i]; b; b = b->next)
+                if (findbuiltin(b->name) == b)
+                    list[n++] = b;
+        qsort(list, n, sizeof(*list), cmpbuiltin);
+        for (i = 0; i < n; i++)
+            printf("%-10s %s\n", list[i]->name, list[i]->lib ? list[i]->lib
+                   : list[i]->cmd ? "shell builtin" : "utility");
+        free(list);
+        return;
+    }
+    if (!strcmp(argv[1], "-f") && argv[2]){
+        loadplugin(argv[2], argv + 3);
+        return;
+    }
+    if (!strcmp(argv[1], "-d") && argv[2]){
+        for (name = argv + 2; *name; name++){
+            for (bp = &builtins[builtinhash(*name)]; *bp; bp = &(*bp)->next)
+                if (!strcmp((*bp)->name, *name))
+                    break;
+            if (!*bp || !(*bp)->lib){
+                printf("enable: %s: not a plugin builtin\n", *name);
+                continue;
+            }
+            // The object stays loaded; a fork of ours may be running it
+            b = *bp;
+            *bp = b->next;
+            free(b);
+        }
+        return;
+    }
+    printf("usage: enable [-f lib.so [name...] | -d name...]\n");
+}
+
+/* cmpbuiltin - qsort order of builtins: by name */
+int cmpbuiltin(const void *a, const void *b) {
+    return strcmp((*(const struct builtin_t **)a)->name,
+                  (*(const struct builtin_t **)b)->name);
+}
+
+/*
+ * loadplugin - dlopen lib and add the commands in names (or all of them,
+ *    if names is empty) from the table its tsh_plugin_init returns.
+ *    Returns how many were added, or -1 if lib isn't a usable plugin.
+ */
+int loadplugin(const char *lib, char **names) {
+    const struct tsh_builtin *table, *t;
+    tsh_plugin_init_fn init;
+    struct builtin_t *b;
+    char **name, *libname;
+    void *handle;
+    int added = 0;
+
+    if (!(handle = dlopen(lib, RTLD_NOW | RTLD_LOCAL))){
+        printf("enable: %s\n", dlerror());
+        return -1;
+    }
+    if (!(init = (tsh_plugin_init_fn)dlsym(handle, TSH_PLUGIN_INIT))){
+        printf("enable: %s: not a tsh plugin\n", lib);
+        dlclose(handle);
+        return -1;
+    }
+    if (!(table = init(TSH_PLUGIN_ABI))){
+        printf("enable: %s: can't use plugin ABI %d\n", lib, TSH_PLUGIN_ABI);
+        dlclose(handle);
+        return -1;
+    }
+
+    for (name = names; *name; name++){
+        for (t = table; t->name && strcmp(t->name, *name); t++)
+            ;
+        if (!t->name)
+            printf("enable: %s: not in %s\n", *name, lib);
+    }
+    if (!(libname = strdup(lib)))
+        unix_error("strdup error");
+    for (t = table; t->name; t++){
+        for (name = names; *name && strcmp(t->name, *name); name++)
+            ;
+        if (!t->fn || (*names && !*name))
+            continue;
+        if (!(b = calloc(1, sizeof(*b))))
+            unix_error("calloc error");
+        b->name = t->name;
+        b->fn = t->fn;
+        b->lib = libname;
+        addbuiltin(b);
+        added++;
+    }
+
+    // Nothing refers to it, so it can go again
+    if (!added){
+        free(libname);
+        dlclose(handle);
+    }
+    return added;
+}
+
+/*****************
+ * Utilities run in the shell
+ *
+ * echo, printf, test ([), true and false are run so often that the
+ * fork and exec cost more than they do. These run them on the shell's
+ * own stdio instead, with the stage's stdin and stdout swapped in.
+ * Plugin commands run the same way.
+ *****************/
+
+/*
+ * runlocal - Run a utility for stage in the shell. Its stdin and
+ *    stdout are the stage's files, or else infd and outfd (-1 to leave
+ *    them alone), dup'd over the shell's own for as long as it runs.
+ *    Returns its exit status.
+ */
+int runlocal(const struct builtin_t *util, struct stage_t *stage, int infd, int outfd) {
+    int filein = -1, fileout = -1, savein = -1, saveout = -1;
+    int argc, status = 1;
+
+    if (stage->infile && (filein = open(stage->infile, O_RDONLY | O_CLOEXEC)) < 0){
+        perror("Could not open file for reading");
+        return 1;
+    }
+    if (stage->outfile && (fileout = open(stage->outfile,
+                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0){
+        perror("Could not open file for writing");
+        if (filein >= 0)
+            close(filein);
+        return 1;
+    }
+    if (filein >= 0)
+        infd = filein;
+    if (fileout >= 0)
+        outfd = fileout;
+
+    // Whatever is buffered belongs to the old stdout
+    fflush(stdout);
+    if (infd >= 0){
+        savein = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 3);
+        dup2(infd, STDIN_FILENO);
+    }
+    if (outfd >= 0){
+        saveout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+        dup2(outfd, STDOUT_FILENO);
+    }
+
+    for (argc = 0; stage->argv[argc]; argc++)
+        ;
+    TRACE(util->name, 'B', 0, 0);
+    status = util->fn(argc, stage->argv, STDIN_FILENO, STDOUT_FILENO);
+    TRACE(util->name, 'E', 0, 0);
+
+    // A reader that went away leaves an error on stdout; it's not ours
+    fflush(stdout);
+    clearerr(stdout);
+    if (savein >= 0){
+        dup2(savein, STDIN_FILENO);
+        close(savein);
+    }
+    if (saveout >= 0){
+        dup2(saveout, STDOUT_FILENO);
+        close(saveout);
+    }
+    if (filein >= 0)
+        close(filein);
+    if (fileout >= 0)
+        close(fileout);
+    return status;
+}
+
+/*
+ * forklocal - Run a utility for stage in a fork of the shell, in
+ *    process group pgid, for when it can't run in the shell itself.
+ *    It's a process of the job like any other. Returns its PID.
+ */
+pid_t forklocal(const struct builtin_t *util, struct stage_t *stage, pid_t pgid, int infd, int outfd) {
+    pid_t pid = fork();
+
+    if (pid < 0)
+        unix_error("fork");
+    if (pid == 0){
+        sigprocmask(SIG_SETMASK, &child_mask, NULL);
+        setpgid(0, pgid);
+        waithold();
+        if (infd >= 0)
+            dup2(infd, STDIN_FILENO);
+        if (outfd >= 0)
+            dup2(outfd, STDOUT_FILENO);
+        // Nothing gets exec'd to close the shell's fds, and a pipe end
+        // left open here would keep the stages around it from EOF
+        syscall(SYS_close_range, 3, ~0U, 0);
+        _exit(runlocal(util, stage, -1, -1));
+    }
+    setpgid(pid, pgid ? pgid : pid);
+    return pid;
+}
+
+/*
+ * do_echo - echo [-neE] [args...]: print the arguments and a newline.
+ *    -n leaves off the newline, and -e decodes backslash escapes (with
+ *    octal as \0NNN), as GNU echo does.
+ */
+int do_echo(int argc, char **argv, int infd, int outfd) {
+    int newline = 1, escapes = 0, stop = 0, i;
+    const char *p;
+
+    for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1] &&
+                !argv[i][1 + strspn(argv[i] + 1, "neE")]; i++)
+        for (p = argv[i] + 1; *p; p++)
+            if (*p == 'n')
+                newline = 0;
+            else
+                escapes = *p == 'e';
+
+    for (; i < argc && !stop; i++){
+        if (!escapes)
+            fputs(argv[i], stdout);
+        else
+            for (p = argv[i]; *p && !stop; )
+                if (*p == '\\' && p[1])
+                    p = putescape(p + 1, 1, &stop);
+                else
+                    putchar(*p++);
+        if (i < argc - 1 && !stop)
+            putchar(' ');
+    }
+    if (newline && !stop)
+        putchar('\n');
+    return 0;
+}
+
+/*
+ * putescape - Print the character that the backslash escape at s
+ *    (just past the backslash) stands for, and return where it ends.
+ *    Octal is \0NNN if octal0 is set (echo -e, %b) and \NNN if not
+ *    (printf formats). \c sets *stop. Unknown escapes print as is.
+ */
+const char *putescape(const char *s, int octal0, int *stop) {
+    static const char from[] = "\\abefnrtv", to[] = "\\\a\b\033\f\n\r\t\v";
+    const char *p;
+    int c = 0, n;
+
+    if ((p = strchr(from, *s)) && *s){
+        putchar(to[p - from]);
+        return s + 1;
+    }
+    if (*s == 'c'){
+        *stop = 1;
+        return s + 1;
+    }
+    if (*s >= '0' && *s <= '7'){
+        p = s + (octal0 && *s == '0');
+        for (n = 0; n < 3 && *p >= '0' && *p <= '7'; n++, p++)
+            c = 8 * c + *p - '0';
+        putchar(c);
+        return p;
+    }
+    if (*s == 'x' && isxdigit((unsigned char)s[1])){
+        for (p = s + 1, n = 0; n < 2 && isxdigit((unsigned char)*p); n++, p++)
+            c = 16 * c + (isdigit((unsigned char)*p) ? *p - '0' : tolower(*p) - 'a' + 10);
+        putchar(c);
+        return p;
+    }
+    putchar('\\');
+    return s;
+}
+
+/*
+ * do_printf - printf format [args...]: print args under the control of
+ *    format, as printf(1) does. The format is used again while there
+ *    are arguments left; missing ones are empty or zero.
+ */
+int do_printf(int argc, char **argv, int infd, int outfd) {
+    char **arg = argv + 2, **end = argv + argc, spec[64];
+    const char *p, *q, *s;
+    int status = 0, stop = 0;
+    size_t len;
+
+    if (argc < 2){
+        printf("usage: printf format [arguments]\n");
+        return 2;
+    }
+    do {
+        char **first = arg;
+        for (p = argv[1]; *p && !stop; p++){
+            if (*p == '\\' && p[1]){
+                p = putescape(p + 1, 0, &stop) - 1;
+                continue;
+            }
+            if (*p != '%' || p[1] == '%'){
+                putchar(*p);
+                p += *p == '%';
+                continue;
+            }
+
+            // Keep the flags, width and precision for the C printf
+            q = p + 1 + strspn(p + 1, "-+ #0");
+            q += strspn(q, "0123456789");
+            if (*q == '.')
+                q += 1 + strspn(q + 1, "0123456789");
+            len = q - p;
+            if (len > sizeof(spec) - 4 || !*q){
+                printf("printf: %s: invalid format\n", p);
+                return 1;
+            }
+            memcpy(spec, p, len);
+            s = arg < end ? *arg++ : NULL;
+            switch (*q){
+            case 'd': case 'i':
+                strcpy(spec + len, "lld");
+                spec[len + 2] = *q;
+                printf(spec, numarg(s, &status));
+                break;
+            case 'u': case 'o': case 'x': case 'X':
+                strcpy(spec + len, "ll");
+                spec[len + 2] = *q;
+                spec[len + 3] = '\0';
+                printf(spec, (unsigned long long)numarg(s, &status));
+                break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+                spec[len] = *q;
+                spec[len + 1] = '\0';
+                printf(spec, s ? strtod(s, NULL) : 0.0);
+                break;
+            case 'c':
+                spec[len] = 'c';
+                spec[len + 1] = '\0';
+                printf(spec, s ? *s : '\0');
+                break;
+            case 's':
+                spec[len] = 's';
+                spec[len + 1] = '\0';
+                printf(spec, s ? s : "");
+                break;
+            case 'b':
+                for (; s && *s && !stop; )
+                    if (*s == '\\' && s[1])
+                        s = putescape(s + 1, 1, &stop);
+                    else
+                        putchar(*s++);
+                break;
+            default:
+                printf("printf: %%%c: invalid directive\n", *q);
+                return 1;
+            }
+            p = q;
+        }
+        // Go around again only if the format took arguments
+        if (arg == first)
+            break;
+    } while (arg < end && !stop);
+    return status;
+}
+
+/*
+ * numarg - Convert a printf argument to a number. 'c and "c are the
+ *    code of c. Sets *status to 1 if s isn't a number.
+ */
+long long numarg(const char *s, int *status) {
+    char *end;
+    long long n;
+
+    if (!s)
+        return 0;
+    if (*s == '\'' || *s == '"')
+        return (unsigned char)s[1];
+    errno = 0;
+    n = strtoll(s, &end, 0);
+    if (end == s || *end || errno){
+        printf("printf: %s: invalid number\n", s);
+        *status = 1;
+    }
+    return n;
+}
+
+/*
+ * do_test - test expr, or [ expr ]: exit 0 if expr is true, 1 if it's
+ *    false and 2 if it can't be parsed. Understands the test(1) file,
+ *    string and integer primaries, !, -a, -o and parentheses.
+ */
+int do_test(int argc, char **argv, int infd, int outfd) {
+    struct testargs_t t = {argv + 1, argv + argc, 0};
+    const char *name = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+    int result;
+
+    if (!strcmp(name, "[")){
+        if (argc < 2 || strcmp(argv[argc - 1], "]")){
+            printf("[: missing ]\n");
+            return 2;
+        }
+        t.end--;
+    }
+    if (t.arg == t.end)
+        return 1;
+    result = testor(&t);
+    if (!t.err && t.arg != t.end){
+        printf("test: %s: unexpected argument\n", *t.arg);
+        t.err = 1;
+    }
+    return t.err ? 2 : !result;
+}
+
+/* testor - expr: and [-o and]... */
+int testor(struct testargs_t *t) {
+    int result = testand(t);
+
+    while (!t->err && t->arg < t->end && !strcmp(*t->arg, "-o")){
+        t->arg++;
+        result = testand(t) || result;
+    }
+    return result;
+}
+
+/* testand - and: not [-a not]... */
+int testand(struct testargs_t *t) {
+    int result = testnot(t);
+
+    while (!t->err && t->arg < t->end && !strcmp(*t->arg, "-a")){
+        t->arg++;
+        result = testnot(t) && result;
+    }
+    return result;
+}
+
+/* testnot - not: [!]... primary, though in ! = x the ! is a string */
+int testnot(struct testargs_t *t) {
+    char **a = t->arg;
+
+    if (a + 1 < t->end && !strcmp(*a, "!") &&
+        !(a + 2 < t->end && testbinary(a[0], a[1], a[2], NULL) >= 0)){
+        t->arg++;
+        return !testnot(t);
+    }
+    return testprimary(t);
+}
+
+/*
+ * testprimary - primary: ( expr ), a binary or unary primary, or a
+ *    string, which is true if it isn't empty. As in test(1), an
+ *    operator with nothing to work on is just a string.
+ */
+int testprimary(struct testargs_t *t) {
+    char **a = t->arg;
+    int result;
+
+    if (a >= t->end){
+        printf("test: argument expected\n");
+        t->err = 1;
+        return 0;
+    }
+    if (a + 2 < t->end && testbinary(a[0], a[1], a[2], NULL) >= 0){
+        t->arg += 3;
+        return testbinary(a[0], a[1], a[2], t);
+    }
+    if (!strcmp(*a, "(") && a + 1 < t->end){
+        t->arg++;
+        result = testor(t);
+        if (!t->err && (t->arg >= t->end || strcmp(*t->arg, ")"))){
+            printf("test: ) expected\n");
+            t->err = 1;
+        }
+        t->arg++;
+        return result;
+    }
+    if (a + 1 < t->end && testunary(a[0], a[1], NULL) >= 0){
+        t->arg += 2;
+        return testunary(a[0], a[1], t);
+    }
+    t->arg++;
+    return **a != '\0';
+}
+
+/*
+ * testunary - Evaluate the unary primary op arg. With t NULL, only say
+ *    whether op is one (-1 if it isn't)
+ */
+int testunary(const char *op, const char *arg, struct testargs_t *t) {
+    struct stat st;
+    int isop = op[0] == '-' && op[1] && !op[2] && strchr("bcdefghknprstuwxzLSGO", op[1]);
+
+    if (!t)
+        return isop ? 0 : -1;
+    switch (op[1]){
+    case 'n': return *arg != '\0';
+    case 'z': return *arg == '\0';
+    case 't': return isatty(atoi(arg));
+    case 'r': return access(arg, R_OK) == 0;
+    case 'w': return access(arg, W_OK) == 0;
+    case 'x': return access(arg, X_OK) == 0;
+    case 'h': case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    }
+    if (stat(arg, &st) < 0)
+        return 0;
+    switch (op[1]){
+    case 'b': return S_ISBLK(st.st_mode);
+    case 'c': return S_ISCHR(st.st_mode);
+    case 'd': return S_ISDIR(st.st_mode);
+    case 'e': return 1;
+    case 'f': return S_ISREG(st.st_mode);
+    case 'g': return (st.st_mode & S_ISGID) != 0;
+    case 'k': return (st.st_mode & S_ISVTX) != 0;
+    case 'p': return S_ISFIFO(st.st_mode);
+    case 's': return st.st_size > 0;
+    case 'u': return (st.st_mode & S_ISUID) != 0;
+    case 'S': return S_ISSOCK(st.st_mode);
+    case 'G': return st.st_gid == getegid();
+    case 'O': return st.st_uid == geteuid();
+    }
+    return 0;
+}
+
+/*
+ * testbinary - Evaluate the binary primary a op b. With t NULL, only
+ *    say whether op is one (-1 if it isn't)
+ */
+int testbinary(const char *a, const char *op, const char *b, struct testargs_t *t) {
+    static const char *ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt",
+                                "-le", "-gt", "-ge", "-nt", "-ot", "-ef", NULL};
+    struct stat sa, sb;
+    long long x, y;
+    char *end;
+    int i, cmp, ea, eb;
+
+    for (i = 0; ops[i] && strcmp(op, ops[i]); i++)
+        ;
+    if (!t || !ops[i])
+        return ops[i] ? 0 : -1;
+    if (i < 5){
+        cmp = strcmp(a, b);
+        return i < 2 ? cmp == 0 : i == 2 ? cmp != 0 : i == 3 ? cmp < 0 : cmp > 0;
+    }
+    if (i >= 11){
+        ea = stat(a, &sa) == 0;
+        eb = stat(b, &sb) == 0;
+        if (i == 13)
+            return ea && eb && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+        // A file that exists is newer than one that doesn't
+        if (!ea || !eb)
+            return i == 11 ? ea && !eb : !ea && eb;
+        cmp = sa.st_mtim.tv_sec != sb.st_mtim.tv_sec ?
+              (sa.st_mtim.tv_sec > sb.st_mtim.tv_sec ? 1 : -1) :
+              (sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec) - (sa.st_mtim.tv_nsec < sb.st_mtim.tv_nsec);
+        return i == 11 ? cmp > 0 : cmp < 0;
+    }
+    x = strtoll(a, &end, 10);
+    if (end == a || *end){
+        printf("test: %s: integer expression expected\n", a);
+        t->err = 1;
+        return 0;
+    }
+    y = strtoll(b, &end, 10);
+    if (end == b || *end){
+        printf("test: %s: integer expression expected\n", b);
+        t->err = 1;
+        return 0;
+    }
+    switch (i){
+    case 5: return x == y;
+    case 6: return x != y;
+    case 7: return x < y;
+    case 8: return x <= y;
+    case 9: return x > y;
+    }
+    return x >= y;
+}
+
+/* do_true - true: exit 0 */
+int do_true(int argc, char **argv, int infd, int outfd) {
+    return 0;
+}
+
+/* do_false - false: exit 1 */
+int do_false(int argc, char **argv, int infd, int outfd) {
+    return 1;
+}
+
+/*****************
+ * Command history
+ *
+ * Lines typed at the prompt are appended to a file that is mapped, not
+ * read, at startup, so starting takes no longer however big it gets.
+ * Each entry's exit status and duration are written into it in place
+ * once its job is done. The entries are read and indexed by trigram
+ * the first time they're searched, and as they're added from then on.
+ *****************/
+
+/* The bytes a history entry of len bytes takes up in the file */
+#define HISTRECSIZE(len) ((sizeof(struct histrec_t) + (len) + 1 + 7) & ~(size_t)7)
+
+/*
+ * inithist - Map the history file, $TSH_HISTFILE or else ~/.tsh_history
+ *    if stdin is a terminal, creating it if need be. Without one, or if
+ *    it isn't a history file, there's no history.
+ */
+void inithist(void) {
+    char *path = getenv("TSH_HISTFILE"), *home, buf[PATH_MAX];
+    struct histhdr_t hdr = {HISTMAGIC, sizeof(hdr)};
+    struct stat sb;
+    int ok;
+
+    if (!path || !*path){
+        if (!isatty(STDIN_FILENO) || !(home = getenv("HOME")))
+            return;
+        snprintf(buf, sizeof(buf), "%s/.tsh_history", home);
+        path = buf;
+    }
+    if ((histfd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0)
+        return;
+
+    // Other shells may share it; whoever gets here first writes the header
+    flock(histfd, LOCK_EX);
+    if (fstat(histfd, &sb) == 0 && sb.st_size == 0
+            && (ftruncate(histfd, HISTCHUNK) < 0
+                || pwrite(histfd, &hdr, sizeof(hdr), 0) != sizeof(hdr)))
+        ok = 0;
+    else
+        ok = histmap() && !memcmp(hist->magic, HISTMAGIC, sizeof(hist->magic))
+            && hist->end >= sizeof(hdr) && hist->end <= histcap;
+    flock(histfd, LOCK_UN);
+    if (!ok){
+        printf("%s: not a history file, not keeping history\n", path);
+        if (hist)
+            munmap(hist, histcap);
+        hist = NULL;
+        close(histfd);
+        histfd = -1;
+        return;
+    }
+    histidx.end = sizeof(hdr);
+}
+
+/*
+ * histmap - Map all of the history file, again if another shell has
+ *    grown it. Returns 0 if it can't be mapped.
+ */
+int histmap(void) {
+    struct stat sb;
+
+    if (fstat(histfd, &sb) < 0 || (size_t)sb.st_size < sizeof(struct histhdr_t))
+        return 0;
+    if ((size_t)sb.st_size == histcap)
+        return 1;
+    if (hist)
+        munmap(hist, histcap);
+    hist = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, histfd, 0);
+    if (hist == MAP_FAILED){
+        hist = NULL;
+        histcap = 0;
+        return 0;
+    }
+    histcap = sb.st_size;
+    return 1;
+}
+
+/*
+ * histadd - Append line to the history, still running. Returns where
+ *    its entry is, for histdone, or 0 if it wasn't added.
+ */
+uint64_t histadd(const char *line) {
+    size_t len = strlen(line), size, cap;
+    struct histrec_t *rec;
+    uint64_t off = 0;
+
+    // A line continued with a backslash keeps its inner newlines
+    if (len > 0 && line[len - 1] == '\n')
+        len--;
+    size = HISTRECSIZE(len);
+    if (histfd < 0 || strspn(line, " \t") >= len)
+        return 0;
+    flock(histfd, LOCK_EX);
+    if (!histmap())
+        goto out;
+    if (hist->end + size > histcap){
+        for (cap = histcap; cap < hist->end + size; cap *= 2)
+            ;
+        if (ftruncate(histfd, cap) < 0 || !histmap())
+            goto out;
+    }
+    off = hist->end;
+    rec = (struct histrec_t *)((char *)hist + off);
+    rec->len = len;
+    rec->status = HISTRUNNING;
+    rec->when = time(NULL);
+    rec->dur = 0;
+    memcpy(rec->text, line, len);
+    rec->text[len] = '\0';
+    // Readers only look as far as end, so the entry is whole before it moves
+    __atomic_store_n(&hist->end, off + size, __ATOMIC_RELEASE);
+out:
+    flock(histfd, LOCK_UN);
+    return off;
+}
+
+/* histdone - Record how the history entry at off ended, if there is one */
+void histdone(uint64_t off, int status, long long dur) {
+    struct histrec_t *rec;
+
+    if (!off || !hist || off + sizeof(*rec) > histcap)
+        return;
+    rec = (struct histrec_t *)((char *)hist + off);
+    rec->dur = dur;
+    rec->status = status;
+}
+
+/* histrec - The history entry with index id (numbered from 0) */
+struct histrec_t *histrec(int id) {
+    return (struct histrec_t *)((char *)hist + histidx.recs[id]);
+}
+
+/*
+ * histscan - Read the entries added to the history file since it was
+ *    last scanned, by us or by another shell, indexing them if there's
+ *    an index to keep up
+ */
+void histscan(void) {
+    struct histrec_t *rec;
+    uint64_t end;
+    size_t size;
+
+    if (!histmap())
+        return;
+    end = __atomic_load_n(&hist->end, __ATOMIC_ACQUIRE);
+    if (end > histcap)
+        end = histcap;
+    while (histidx.end + sizeof(*rec) <= end){
+        rec = (struct histrec_t *)((char *)hist + histidx.end);
+        size = HISTRECSIZE(rec->len);
+        if (histidx.end + size > end)
+            break;      /* torn or corrupt; stop at the last good entry */
+        if (histidx.nrecs == histidx.reccap){
+            histidx.reccap = histidx.reccap ? 2 * histidx.reccap : 1024;
+            if (!(histidx.recs = realloc(histidx.recs, histidx.reccap * sizeof(*histidx.recs))))
+                unix_error("realloc error");
+        }
+        histidx.recs[histidx.nrecs] = histidx.end;
+        if (histidx.grams)
+            histindex(histidx.nrecs);
+        histidx.nrecs++;
+        histidx.end += size;
+    }
+}
+
+/* histgrams - Build the trigram index of the history, if there isn't one */
+void histgrams(void) {
+    int id;
+
+    if (histidx.grams)
+        return;
+    histidx.gramcap = 4096;
+    if (!(histidx.grams = calloc(histidx.gramcap, sizeof(*histidx.grams))))
+        unix_error("calloc error");
+    for (id = 0; id < histidx.nrecs; id++)
+        histindex(id);
+}
+
+/*
+ * histindex - Add history entry id to the trigram index: under every
+ *    three bytes in a row in it, and under its first three (padded with
+ *    NULs) for prefix searches
+ */
+void histindex(int id) {
+    const unsigned char *t = (const unsigned char *)histrec(id)->text;
+    uint32_t len = histrec(id)->len, i;
+
+    addgram(1 << 24 | t[0] << 16 | (len > 1 ? t[1] << 8 : 0) | (len > 2 ? t[2] : 0), id);
+    for (i = 0; i + 2 < len; i++)
+        addgram(t[i] << 16 | t[i + 1] << 8 | t[i + 2], id);
+}
+
+/*
+ * findgram - Return the trigram index entry for key, or NULL if there
+ *    isn't one, unless add is set, in which case an empty one is made
+ *    and counted
+ */
+struct trigram_t *findgram(uint32_t key, int add) {
+    struct trigram_t *old, *g;
+    int i, oldcap;
+
+    // Keep it at most 3/4 full, so probes stay short
+    if (add && 4 * (histidx.ngrams + 1) > 3 * histidx.gramcap){
+        old = histidx.grams;
+        oldcap = histidx.gramcap;
+        histidx.gramcap *= 2;
+        histidx.ngrams = 0;
+        if (!(histidx.grams = calloc(histidx.gramcap, sizeof(*histidx.grams))))
+            unix_error("calloc error");
+        for (i = 0; i < oldcap; i++){
+            if (!old[i].key)
+                continue;
+            g = findgram(old[i].key, 1);
+            *g = old[i];
+        }
+        free(old);
+    }
+
+    for (i = (key * 0x9e3779b1u) & (histidx.gramcap - 1);
+         histidx.grams[i].key; i = (i + 1) & (histidx.gramcap - 1))
+        if (histidx.grams[i].key == key)
+            return &histidx.grams[i];
+    if (!add)
+        return NULL;
+    histidx.grams[i].key = key;
+    histidx.ngrams++;
+    return &histidx.grams[i];
+}
+
+/* addgram - Note that history entry id holds trigram key */
+void addgram(uint32_t key, uint32_t id) {
+    struct trigram_t *g = findgram(key, 1);
+
+    // Entries come in order, so a repeat can only be the last one
+    if (g->n && g->ids[g->n - 1] == id)
+        return;
+    if (g->n == g->cap){
+        g->cap = g->cap ? 2 * g->cap : 4;
+        if (!(g->ids = realloc(g->ids, g->cap * sizeof(*g->ids))))
+            unix_error("realloc error");
+    }
+    g->ids[g->n++] = id;
+}
+
+/*
+ * histfind - Print the history entries starting with pat (if prefix is
+ *    set) or holding it. Only entries under the rarest of pat's trigrams
+ *    need to be looked at; a pat shorter than that means reading them all.
+ */
+void histfind(const char *pat, int prefix) {
+    size_t len = strlen(pat), i;
+    struct trigram_t *g, *best = NULL;
+    const unsigned char *p = (const unsigned char *)pat;
+    const char *text;
+    int id, j;
+
+    histscan();
+    histgrams();
+    if (len < 3){
+        for (id = 0; id < histidx.nrecs; id++){
+            text = histrec(id)->text;
+            if (prefix ? !strncmp(text, pat, len) : !!strstr(text, pat))
+                printhist(id);
+        }
+        return;
+    }
+
+    // A trigram that's in no entry means pat is in none either
+    if (prefix && !(best = findgram(1 << 24 | p[0] << 16 | p[1] << 8 | p[2], 0)))
+        return;
+    for (i = 0; i + 2 < len; i++){
+        if (!(g = findgram(p[i] << 16 | p[i + 1] << 8 | p[i + 2], 0)))
+            return;
+        if (!best || g->n < best->n)
+            best = g;
+    }
+    for (j = 0; j < best->n; j++){
+        id = best->ids[j];
+        text = histrec(id)->text;
+        if (prefix ? !strncmp(text, pat, len) : !!strstr(text, pat))
+            printhist(id);
+    }
+}
+
+/* printhist - Print history entry id: number, status, duration and line */
+void printhist(int id) {
+    struct histrec_t *rec = histrec(id);
+    char status[16], dur[24];
+
+    if (rec->status == HISTRUNNING){
+        strcpy(status, "-");
+        strcpy(dur, "-");
+    } else {
+        if (WIFSIGNALED(rec->status))
+            sprintf(status, "sig%d", WTERMSIG(rec->status));
+        else
+            sprintf(status, "%d", WEXITSTATUS(rec->status));
+        sprintf(dur, "%lld.%03llds", (long long)rec->dur / 1000000000,
+                (long long)rec->dur / 1000000 % 1000);
+    }
+    printf("%6d  %-5s %10s  %s\n", id + 1, status, dur, rec->text);
+}
+
+/*
+ * do_history - history [n | -p prefix | -s text]: list the last n
+ *    entries (all of them by default), or those starting with prefix or
+ *    holding text
+ */
+void do_history(char **argv, int bg, char *cmdline) {
+    char *end;
+    long n;
+    int id;
+
+    if (histfd < 0){
+        printf("history: no history file (set TSH_HISTFILE)\n");
+        return;
+    }
+    if (argv[1] && (!strcmp(argv[1], "-p") || !strcmp(argv[1], "-s"))){
+        if (!argv[2] || argv[3]){
+            printf("usage: history [n | -p prefix | -s text]\n");
+            return;
+        }
+        histfind(argv[2], argv[1][1] == 'p');
+        return;
+    }
+    histscan();
+    n = histidx.nrecs;
+    if (argv[1] && ((n = strtol(argv[1], &end, 10)) < 0 || *end || end == argv[1] || argv[2])){
+        printf("usage: history [n | -p prefix | -s text]\n");
+        return;
+    }
+    for (id = n < histidx.nrecs ? histidx.nrecs - n : 0; id < histidx.nrecs; id++)
+        printhist(id);
+}
+
+/*****************
+ * Job notifications
+ *
+ * The reaper doesn't print what happened to a job itself. It queues a
+ * note, and the REPL prints the notes before each prompt, after
+ * waiting for a FG job and while it's idle. Both run on the main loop,
+ * so the queue is a plain array.
+ *****************/
+
+/* postnote - Queue a note that job was stopped or killed (what) by sig */
+void postnote(int what, struct job_t *job, int sig) {
+    struct note_t *note;
+
+    if (notes.n == notes.cap){
+        notes.cap = notes.cap ? 2 * notes.cap : NOTES;
+        if (!(notes.notes = realloc(notes.notes, notes.cap * sizeof(*notes.notes))))
+            unix_error("realloc error");
+    }
+    note = &notes.notes[notes.n++];
+    note->what = what;
+    note->jid = job->jid;
+    note->pid = job->pid;
+    note->sig = sig;
+}
+
+/* drainnotes - Print the notes queued since the last drain, in order */
+void drainnotes(void) {
+    struct note_t *note;
+    int i;
+
+    for (i = 0; i < notes.n; i++){
+        note = &notes.notes[i];
+        printf("Job [%d] (%d) %s by signal %d\n", note->jid, note->pid,
+               note->what == NOTE_STOPPED ? "stopped" : "terminated",
+               note->sig);
+    }
+    notes.n = 0;
+}
+
+/*****************
+ * Tracing
+ *
+ * With tracing on (-T, or trace on), the TRACE points along a job's
+ * life record timestamped events into a ring allocated up front, so an
+ * event costs a clock read and a few stores. trace dump and -T write
+ * the ring out as Chrome trace event JSON, which chrome://tracing and
+ * Perfetto open.
+ *****************/
+
+/* tracepoint - Record a trace event; see TRACE */
+void tracepoint(const char *name, char ph, int jid, pid_t pid) {
+    struct trace_t *t = &traces[ntraces++ & (TRACERING - 1)];
+
+    t->ns = nsnow();
+    t->name = name;
+    t->ph = ph;
+    t->jid = jid;
+    t->pid = pid;
+}
+
+/* starttrace - Turn tracing on, making room for the events the first time */
+void starttrace(void) {
+    if (!traces && !(traces = calloc(TRACERING, sizeof(*traces))))
+        unix_error("calloc error");
+    tracepid = getpid();
+    tracing = 1;
+}
+
+/*
+ * dumptrace - Write the events in the ring to fp as Chrome trace event
+ *    JSON, oldest first. Jobs are async events with their JID as the ID;
+ *    everything else is on the shell's own track. Returns -1 if the
+ *    write failed.
+ */
+int dumptrace(FILE *fp) {
+    unsigned long i = ntraces > TRACERING ? ntraces - TRACERING : 0;
+    struct trace_t *t;
+    const char *c, *sep = "";
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (; i < ntraces; i++, sep = ","){
+        t = &traces[i & (TRACERING - 1)];
+        fprintf(fp, "%s\n{\"name\":\"", sep);
+        // Plugin commands can be called anything
+        for (c = t->name; *c; c++){
+            if (*c == '"' || *c == '\\')
+                fputc('\\', fp);
+            if ((unsigned char)*c >= ' ')
+                fputc(*c, fp);
+        }
+        fprintf(fp, "\",\"ph\":\"%c\",\"ts\":%lld.%03lld,\"pid\":%d,\"tid\":%d",
+                t->ph, t->ns / 1000, t->ns % 1000, tracepid, tracepid);
+        if (t->ph == 'b' || t->ph == 'e')
+            fprintf(fp, ",\"cat\":\"job\",\"id\":%d", t->jid);
+        else if (t->ph == 'i')
+            fprintf(fp, ",\"s\":\"t\"");
+        if (t->jid || t->pid)
+            fprintf(fp, ",\"args\":{\"jid\":%d,\"pid\":%d}", t->jid, t->pid);
+        fputc('}', fp);
+    }
+    fprintf(fp, "\n]}\n");
+    return fflush(fp) == 0 && !ferror(fp) ? 0 : -1;
+}
+
+/* savetrace - Write the trace to the -T file; run at exit */
+void savetrace(void) {
+    FILE *fp;
+
+    // A child that never made it to exec exits through here too
+    if (getpid() != tracepid)
+        return;
+    if (!(fp = fopen(tracefile, "w")) || dumptrace(fp) < 0)
+        fprintf(stderr, "%s: %s\n", tracefile, strerror(errno));
+    if (fp)
+        fclose(fp);
+}
+
+/*
+ * do_trace - trace [on | off | clear | dump [file]]: say whether jobs are
+ *    being traced, start or stop tracing, forget the events so far, or
+ *    write them out as Chrome trace JSON (to stdout without a file)
+ */
+void do_trace(char **argv, int bg, char *cmdline) {
+    FILE *fp = NULL;
+
+    if (!argv[1]){
+        printf("tracing %s, %lu events (%lu kept)\n", tracing ? "on" : "off",
+               ntraces, ntraces < TRACERING ? ntraces : TRACERING);
+    } else if (!strcmp(argv[1], "on") && !argv[2]){
+        starttrace();
+    } else if (!strcmp(argv[1], "off") && !argv[2]){
+        tracing = 0;
+    } else if (!strcmp(argv[1], "clear") && !argv[2]){
+        ntraces = 0;
+    } else if (!strcmp(argv[1], "dump") && (!argv[2] || !argv[3])){
+        if (!traces)
+            printf("trace: nothing traced yet\n");
+        else if (!argv[2])
+            dumptrace(stdout);
+        else if (!(fp = fopen(argv[2], "w")) || dumptrace(fp) < 0)
+            printf("trace: %s: %s\n", argv[2], strerror(errno));
+        if (fp)
+            fclose(fp);
+    } else
+        printf("usage: trace [on | off | clear | dump [file]]\n");
+}
+
+/*****************
+ * Latency histograms
+ *
+ * Like HDR histograms: values below 2^LATBITS get a bucket each, and
+ * each power of 2 above that is split into 2^(LATBITS-1) buckets, so
+ * any value is known to within 1/64 of itself in a fixed 15K.
+ *****************/
+
+/* latbucket - The bucket of a latency histogram ns falls in */
+int latbucket(unsigned long long ns) {
+    int shift;
+
+    if (ns < 1ULL << LATBITS)
+        return ns;
+    // Keep the top LATBITS bits; the rest say which power of 2 it's in
+    shift = 63 - __builtin_clzll(ns) - (LATBITS - 1);
+    return (shift << (LATBITS - 1)) + (ns >> shift);
+}
+
+/* latvalue - The largest value (ns) that falls in bucket */
+unsigned long long latvalue(int bucket) {
+    int shift = (bucket >> (LATBITS - 1)) - 1;
+
+    if (shift <= 0)
+        return bucket;
+    return ((unsigned long long)(bucket - (shift << (LATBITS - 1))) << shift)
+        + (1ULL << shift) - 1;
+}
+
+/* latrecord - Count ns (if it's a real duration) in latency histogram lat */
+void latrecord(int lat, long long ns) {
+    struct latency_t *l = &latency[lat];
+
+    if (ns < 0)
+        return;
+    l->counts[latbucket(ns)]++;
+    l->count++;
+    l->sum += ns;
+    if ((unsigned long long)ns > l->max)
+        l->max = ns;
+}
+
+/*
+ * latpercentile - The value (ns) that fraction p of the values in l are
+ *    no greater than, give or take a bucket
+ */
+unsigned long long latpercentile(const struct latency_t *l, double p) {
+    unsigned long long seen = 0, want = p * l->count + 0.5;
+    int i;
+
+    if (want < 1)
+        want = 1;
+    for (i = 0; i < LATBUCKETS; i++)
+        if ((seen += l->counts[i]) >= want)
+            return latvalue(i) < l->max ? latvalue(i) : l->max;
+    return l->max;
+}
+
+/* fmtns - Format ns in buf in whichever of ns, us, ms or s suits it */
+char *fmtns(unsigned long long ns, char *buf, size_t size) {
+    if (ns < 1000)
+        snprintf(buf, size, "%lluns", ns);
+    else if (ns < 1000000)
+        snprintf(buf, size, "%.1fus", ns / 1e3);
+    else if (ns < 1000000000)
+        snprintf(buf, size, "%.2fms", ns / 1e6);
+    else
+        snprintf(buf, size, "%.3fs", ns / 1e9);
+    return buf;
+}
+
+/*
+ * do_stats - stats [-r | -d]: show percentiles of the shell's latencies,
+ *    reset them (-r), or dump the histograms as JSON (-d), as
+ *    {"parse": {"count": ..., "buckets": [[largest ns, count], ...]}, ...}
+ */
+void do_stats(char **argv, int bg, char *cmdline) {
+    static const double ps[] = {0.5, 0.9, 0.99};
+    struct latency_t *l;
+    const char *sep;
+    char buf[4][16];
+    int i, j;
+
+    if (argv[1] && !strcmp(argv[1], "-r") && !argv[2]){
+        for (i = 0; i < NLAT; i++){
+            l = &latency[i];
+            l->count = l->sum = l->max = 0;
+            memset(l->counts, 0, sizeof(l->counts));
+        }
+        return;
+    }
+    if (argv[1] && !strcmp(argv[1], "-d") && !argv[2]){
+        printf("{");
+        for (i = 0; i < NLAT; i++){
+            l = &latency[i];
+            printf("%s\n\"%s\": {\"count\": %llu, \"sum_ns\": %llu, \"max_ns\": %llu",
+                   i ? "," : "", l->name, l->count, l->sum, l->max);
+            for (j = 0; j < 3; j++)
+                printf(", \"p%g_ns\": %llu", ps[j] * 100,
+                       l->count ? latpercentile(l, ps[j]) : 0);
+            printf(", \"buckets\": [");
+            for (sep = "", j = 0; j < LATBUCKETS; j++)
+                if (l->counts[j]){
+                    printf("%s[%llu, %u]", sep, latvalue(j), l->counts[j]);
+                    sep = ", ";
+                }
+            printf("]}");
+        }
+        printf("\n}\n");
+        return;
+    }
+    if (argv[1]){
+        printf("usage: stats [-r | -d]\n");
+        return;
+    }
+
+    printf("%-8s %8s %9s %9s %9s %9s\n", "", "count", "p50", "p90", "p99", "max");
+    for (i = 0; i < NLAT; i++){
+        l = &latency[i];
+        if (!l->count){
+            printf("%-8s %8d %9s %9s %9s %9s\n", l->name, 0, "-", "-", "-", "-");
+            continue;
+        }
+        for (j = 0; j < 3; j++)
+            fmtns(latpercentile(l, ps[j]), buf[j], sizeof(buf[j]));
+        printf("%-8s %8llu %9s %9s %9s %9s\n", l->name, l->count,
+               buf[0], buf[1], buf[2], fmtns(l->max, buf[3], sizeof(buf[3])));
+    }
+}
+
+/*****************
+ * Perf counters
+ *
+ * A counted job gets perf_event_open counters on every stage: the
+ * software ones always, cycles and instructions where the kernel has a
+ * PMU to count them with. Its stages are started held, so the counters
+ * are opened before they exec; they're opened disabled and the exec
+ * turns them on, which counts the program from its first instruction
+ * and nothing of the shell's fork. A utility that runs in a fork has no
+ * exec and is counted from its release. The counters follow the
+ * stage's children (inherit), are read when it's reaped, and are
+ * summed over the job. An event the kernel won't count is given up on
+ * after the first try, so a VM without a PMU just goes without.
+ *****************/
+
+/*
+ * perfjob - Count job, and report its counters when it's done if
+ *    report is set. Stages that started since the last call (all of
+ *    them, the first time) get their counters now, before they're
+ *    released; a pending job gets its counters once it starts.
+ */
+void perfjob(struct job_t *job, int report) {
+    struct perf_t *perf = job->perf;
+    int i, j;
+
+    if (!perf){
+        if (!(perf = calloc(1, sizeof(*perf))))
+            unix_error("calloc error");
+        job->perf = perf;
+    }
+    perf->report = report;
+    if (perf->nfds >= job->nprocs * NPERF)
+        return;
+    if (!(perf->fds = realloc(perf->fds, job->nprocs * NPERF * sizeof(*perf->fds))))
+        unix_error("realloc error");
+    for (i = perf->nfds / NPERF; i < job->nprocs; i++)
+        for (j = 0; j < NPERF; j++)
+            perf->fds[i * NPERF + j] = !job->procs[i].pid ? -1 :
+                perfopen(j, job->procs[i].pid, holdfds[0] >= 0 && !job->procs[i].local);
+    perf->nfds = job->nprocs * NPERF;
+}
+
+/*
+ * perfopen - Open a counter of perfevents[event] on process pid and its
+ *    future children. If onexec is set, it only starts counting when
+ *    pid execs. Returns the fd, or -1.
+ */
+int perfopen(int event, pid_t pid, int onexec) {
+    struct perfevent_t *ev = &perfevents[event];
+    struct perf_event_attr attr;
+    int fd;
+
+    if (ev->err)
+        return -1;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = ev->type;
+    attr.config = ev->config;
+    attr.inherit = 1;
+    attr.disabled = onexec;
+    attr.enable_on_exec = onexec;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+
+    // A stage that's gone already just isn't counted; anything else means
+    // the kernel won't count this event at all
+    if (fd < 0 && errno != ESRCH)
+        ev->err = errno;
+    return fd;
+}
+
+/*
+ * perfread - Read the counter fd, scaled up for the time it wasn't
+ *    running if the PMU was shared
+ */
+uint64_t perfread(int fd) {
+    uint64_t v[3];
+
+    if (fd < 0 || read(fd, v, sizeof(v)) != sizeof(v))
+        return 0;
+    if (v[2] && v[2] < v[1])
+        return (double)v[0] * v[1] / v[2];
+    return v[0];
+}
+
+/* perfreap - Add the counts of the reaped stage to its job's, and close them */
+void perfreap(struct job_t *job, int stage) {
+    struct perf_t *perf = job->perf;
+    int j, *fd;
+
+    if (stage >= perf->nfds / NPERF)
+        return;
+    for (j = 0; j < NPERF; j++){
+        fd = &perf->fds[stage * NPERF + j];
+        if (*fd >= 0){
+            perf->counts[j] += perfread(*fd);
+            close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+/* perfcounts - What job has counted so far, reaped stages and live ones */
+void perfcounts(struct job_t *job, uint64_t *counts) {
+    struct perf_t *perf = job->perf;
+    int i;
+
+    for (i = 0; i < NPERF; i++)
+        counts[i] = perf->counts[i];
+    for (i = 0; i < perf->nfds; i++)
+        counts[i % NPERF] += perfread(perf->fds[i]);
+}
+
+/* perffree - Close job's counters and forget them */
+void perffree(struct job_t *job) {
+    struct perf_t *perf = job->perf;
+    int i;
+
+    if (!perf)
+        return;
+    for (i = 0; i < perf->nfds; i++)
+        if (perf->fds[i] >= 0)
+            close(perf->fds[i]);
+    free(perf->fds);
+    free(perf);
+    job->perf = NULL;
+}
+
+/* perfreport - Print job's counters, perf stat style */
+void perfreport(struct job_t *job) {
+    uint64_t counts[NPERF];
+    int i;
+
+    perfcounts(job, counts);
+    printf("Perf counters for job [%d] (%d):\n", job->jid, job->pid);
+    for (i = 0; i < NPERF; i++){
+        if (perfevents[i].err)
+            printf("%18s  %-16s (%s)\n", "<not supported>", perfevents[i].name,
+                   strerror(perfevents[i].err));
+        else if (perfevents[i].config == PERF_COUNT_SW_TASK_CLOCK
+                 && perfevents[i].type == PERF_TYPE_SOFTWARE)
+            printf("%18.2f  msec %s\n", counts[i] / 1e6, perfevents[i].name);
+        else
+            printf("%18llu  %s\n", (unsigned long long)counts[i], perfevents[i].name);
+    }
+    // Without any counters there's still what the kernel accounted
+    if (perfevents[0].err)
+        printusage(nsnow() - job->start, &job->ru);
+}
+
+/* perfjobs - List the counted jobs with what they've counted so far */
+void perfjobs(struct joblist_t *jobs) {
+    uint64_t counts[NPERF];
+    struct job_t *job;
+    int i, j;
+
+    for (i = 1; i <= jobs->maxjid; i++) {
+        if (!(job = jobs->byjid[i]) || !job->perf)
+            continue;
+        perfcounts(job, counts);
+        printf("[%d] (%d)", job->jid, job->pid);
+        for (j = 0; j < NPERF; j++){
+            if (perfevents[j].err)
+                continue;
+            if (j == 0)
+                printf(" %s=%.2fms", perfevents[j].name, counts[j] / 1e6);
+            else
+                printf(" %s=%llu", perfevents[j].name, (unsigned long long)counts[j]);
+        }
+        printf(" %s", job->cmdline);
+    }
+}
+
+/*
+ * do_perfstat - perfstat -a [on | off]: say whether every job is being
+ *    counted, or start or stop counting them. perfstat cmd, which counts
+ *    just cmd and reports when it's done, is a job prefix; see jobprefix
+ */
+void do_perfstat(char **argv, int bg, char *cmdline) {
+    if (argv[1] && !strcmp(argv[1], "-a") && !argv[2])
+        printf("perfstat: counting %s\n", perfall ? "every job" : "perfstat jobs only");
+    else if (argv[1] && !strcmp(argv[1], "-a") && !strcmp(argv[2], "on") && !argv[3])
+        perfall = 1;
+    else if (argv[1] && !strcmp(argv[1], "-a") && !strcmp(argv[2], "off") && !argv[3])
+        perfall = 0;
+    else
+        printf("usage: perfstat cmd [args...] | perfstat -a [on | off]\n");
+}
+
+/*****************
+ * Job monitor
+ *
+ * jtop samples every process in each job's process group from /proc at
+ * an interval and shows what each job is using. Linux can't list a
+ * process group, so every sample reads the PIDs in /proc and keeps the
+ * ones in a job's group; a process is looked at once to find out which
+ * group it's in, and after that only job members are read. Their stat,
+ * statm and io files stay open between samples and are read again
+ * with pread, so a sample costs three reads per process rather than
+ * three opens, reads and closes.
+ *****************/
+
+/*
+ * do_jtop - jtop [-d secs] [-n count]: show the jobs' CPU, memory, I/O
+ *    and threads every secs (1 by default), count times or, on a
+ *    terminal, until ctrl-c. Jobs keep being reaped and started
+ *    meanwhile. Off a terminal it samples once unless told otherwise.
+ */
+void do_jtop(char **argv, int bg, char *cmdline) {
+    struct jtop_t top;
+    struct jtopjob_t *sums = NULL;
+    int tty = isatty(STDOUT_FILENO);
+    long count = tty ? 0 : 1, n;
+    double delay = 1;
+    long long next, left;
+    int i, nsums = 0;
+    char *end;
+
+    for (i = 1; argv[i]; i++) {
+        if (!strcmp(argv[i], "-d") && argv[i + 1]) {
+            delay = strtod(argv[++i], &end);
+            if (*end || !(delay > 0))
+                break;
+        } else if (!strcmp(argv[i], "-n") && argv[i + 1]) {
+            count = strtol(argv[++i], &end, 10);
+            if (*end || count <= 0)
+                break;
+        } else
+            break;
+    }
+    if (argv[i]) {
+        printf("usage: jtop [-d secs] [-n count]\n");
+        return;
+    }
+
+    memset(&top, 0, sizeof(top));
+    if (!(top.proc = opendir("/proc"))) {
+        printf("jtop: /proc: %s\n", strerror(errno));
+        return;
+    }
+    interrupted = 0;
+    for (n = 0; !interrupted; ) {
+        // Reap whatever has finished, so it isn't shown
+        dispatch_events(0);
+        if (nsums <= jobs->maxjid) {
+            nsums = jobs->maxjid + 1;
+            if (!(sums = realloc(sums, nsums * sizeof(*sums))))
+                unix_error("realloc error");
+        }
+        memset(sums, 0, nsums * sizeof(*sums));
+        jtopsample(&top, sums, nsums);
+        jtopdraw(&top, sums, delay, tty);
+        if (count && ++n >= count)
+            break;
+
+        // Keep reaping and starting jobs until the next sample is due
+        next = nsnow() + (long long)(delay * 1e9);
+        while (!interrupted && (left = next - nsnow()) > 0)
+            dispatch_events((left + 999999) / 1000000);
+    }
+    if (interrupted && tty)
+        printf("\n");
+    interrupted = 0;
+    jtopfree(&top);
+    free(sums);
+}
+
+/*
+ * jtopsample - Find the processes in /proc and sample the ones in a
+ *    job's group, adding what they used to sums[jid]
+ */
+void jtopsample(struct jtop_t *top, struct jtopjob_t *sums, int nsums) {
+    struct jtopproc_t *old = top->procs, *procs, fresh;
+    struct dirent *ent;
+    struct timespec ts;
+    long long now;
+    int i, j, k, n = 0;
+
+    rewinddir(top->proc);
+    while ((ent = readdir(top->proc))) {
+        if (!isdigit((unsigned char)*ent->d_name))
+            continue;
+        if (n == top->pidcap) {
+            top->pidcap = top->pidcap ? top->pidcap * 2 : 256;
+            if (!(top->pids = realloc(top->pids, top->pidcap * sizeof(*top->pids))))
+                unix_error("realloc error");
+        }
+        top->pids[n++] = atoi(ent->d_name);
+    }
+    qsort(top->pids, n, sizeof(*top->pids), cmppid);
+    if (!(procs = malloc((n + 1) * sizeof(*procs))))
+        unix_error("malloc error");
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+    // Both lists are in PID order: carry over what's known of the
+    // processes still there, and forget the ones that are gone
+    memset(&fresh, 0, sizeof(fresh));
+    fresh.jid = -1;
+    fresh.statfd = fresh.statmfd = fresh.iofd = -1;
+    for (i = j = k = 0; i < n; i++) {
+        while (j < top->nprocs && old[j].pid < top->pids[i])
+            jtopclose(&old[j++]);
+        if (j < top->nprocs && old[j].pid == top->pids[i])
+            procs[k] = old[j++];
+        else {
+            procs[k] = fresh;
+            procs[k].pid = top->pids[i];
+        }
+        if (jtopproc(&procs[k], now, sums, nsums) == 0)
+            k++;
+    }
+    while (j < top->nprocs)
+        jtopclose(&old[j++]);
+    free(old);
+    top->procs = procs;
+    top->nprocs = k;
+}
+
+/*
+ * jtopproc - Sample p at now (CLOCK_BOOTTIME ns), if it's in a job's
+ *    group, and add what it used since the last sample (or since it
+ *    started, the first time) to sums[jid]. Returns -1 if it's gone.
+ */
+int jtopproc(struct jtopproc_t *p, long long now, struct jtopjob_t *sums, int nsums) {
+    static long hz, pagesize;
+    struct jtopjob_t *sum;
+    struct job_t *job;
+    unsigned long long utime, stime, start, rss, rchar, wchar;
+    char buf[1024], *s;
+    long long dt;
+    int n, pgrp, threads;
+
+    if (!hz) {
+        hz = sysconf(_SC_CLK_TCK);
+        pagesize = sysconf(_SC_PAGESIZE);
+    }
+    if (p->jid == 0)
+        return 0;
+
+    // A process that was there last time may be gone, or its PID
+    // may have gone to someone new
+    if ((n = procfile(p->pid, "stat", &p->statfd, buf, sizeof(buf))) < 0 && p->jid > 0) {
+        jtopclose(p);
+        p->jid = -1;
+        n = procfile(p->pid, "stat", &p->statfd, buf, sizeof(buf));
+    }
+    // The command name can hold anything, so parse from its closing paren
+    if (n < 0 || !(s = strrchr(buf, ')'))
+            || sscanf(s + 2, "%*c %*d %d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu "
+                      "%*d %*d %*d %*d %d %*d %llu",
+                      &pgrp, &utime, &stime, &threads, &start) != 5) {
+        jtopclose(p);
+        return -1;
+    }
+
+    // Anything outside the jobs' groups is never looked at again
+    job = pgrp > 0 ? getjobpid(jobs, pgrp) : NULL;
+    if (!job || job->pid != pgrp || job->jid >= nsums) {
+        jtopclose(p);
+        p->jid = 0;
+        return 0;
+    }
+    if (p->jid != job->jid) {
+        p->jid = job->jid;
+        p->ticks = p->rchar = p->wchar = 0;
+        p->when = start * 1000000000LL / hz;
+    }
+    sum = &sums[job->jid];
+    sum->nprocs++;
+    sum->nthreads += threads;
+    dt = now - p->when;
+    if (dt > 0)
+        sum->cpu += (utime + stime - p->ticks) * 1e11 / hz / dt;
+    p->ticks = utime + stime;
+    if (procfile(p->pid, "statm", &p->statmfd, buf, sizeof(buf)) > 0
+            && sscanf(buf, "%*u %llu", &rss) == 1)
+        sum->rss += rss * pagesize;
+
+    // rchar and wchar count everything read and written, pipes and
+    // the page cache included, not just what reached a disk
+    if (procfile(p->pid, "io", &p->iofd, buf, sizeof(buf)) > 0
+            && sscanf(buf, "rchar: %llu wchar: %llu", &rchar, &wchar) == 2) {
+        if (dt > 0) {
+            sum->rrate += (rchar - p->rchar) * 1e9 / dt;
+            sum->wrate += (wchar - p->wchar) * 1e9 / dt;
+        }
+        p->rchar = rchar;
+        p->wchar = wchar;
+    }
+    p->when = now;
+    return 0;
+}
+
+/*
+ * procfile - Read /proc/pid/name into buf, NUL terminated, through *fd,
+ *    which is opened the first time. Returns the bytes read, or -1.
+ */
+int procfile(pid_t pid, const char *name, int *fd, char *buf, size_t size) {
+    char path[64];
+    ssize_t n;
+
+    if (*fd < 0) {
+        snprintf(path, sizeof(path), "/proc/%d/%s", pid, name);
+        if ((*fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+            return -1;
+    }
+    if ((n = pread(*fd, buf, size - 1, 0)) < 0)
+        return -1;
+    buf[n] = '\0';
+    return n;
+}
+
+/* jtopclose - Close the /proc files of p */
+void jtopclose(struct jtopproc_t *p) {
+    if (p->statfd >= 0)
+        close(p->statfd);
+    if (p->statmfd >= 0)
+        close(p->statmfd);
+    if (p->iofd >= 0)
+        close(p->iofd);
+    p->statfd = p->statmfd = p->iofd = -1;
+}
+
+/*
+ * jtopdraw - Print a sample, one line per job. On a terminal it's drawn
+ *    over the last one, with command lines cut to fit.
+ */
+void jtopdraw(struct jtop_t *top, struct jtopjob_t *sums, double delay, int tty) {
+    static const char *states[] = {"Undefined", "Foreground", "Running", "Stopped", "Pending"};
+    const char *eol = tty ? "\033[K\n" : "\n";
+    char rss[16], rrate[16], wrate[16];
+    struct jtopjob_t *sum;
+    struct job_t *job;
+    struct winsize ws;
+    int i, len, room, njobs = 0, nprocs = 0;
+
+    for (i = 1; i <= jobs->maxjid; i++)
+        if (jobs->byjid[i]) {
+            njobs++;
+            nprocs += sums[i].nprocs;
+        }
+    room = tty && ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 70
+        ? ws.ws_col - 70 : INT_MAX;
+
+    printf("%sjtop: %d jobs, %d processes, every %gs%s", tty ? "\033[H" : "",
+           njobs, nprocs, delay, eol);
+    printf("%5s %7s %-10s %5s %5s %6s %7s %7s %7s  %s%s", "JID", "PGID", "STATE",
+           "PROCS", "THR", "%CPU", "RSS", "READ/s", "WRITE/s", "COMMAND", eol);
+    for (i = 1; i <= jobs->maxjid; i++) {
+        if (!(job = jobs->byjid[i]))
+            continue;
+        sum = &sums[i];
+        len = strcspn(job->cmdline, "\n");
+        printf("%5d %7d %-10s %5d %5d %6.1f %7s %7s %7s  %.*s%s", job->jid, job->pid,
+               states[job->state], sum->nprocs, sum->nthreads, sum->cpu,
+               fmtbytes(sum->rss, rss, sizeof(rss)),
+               fmtbytes(sum->rrate, rrate, sizeof(rrate)),
+               fmtbytes(sum->wrate, wrate, sizeof(wrate)),
+               len < room ? len : room, job->cmdline, eol);
+    }
+    printf("%s", tty ? "\033[J" : "\n");
+    fflush(stdout);
+}
+
+/* jtopfree - Close everything jtop had open */
+void jtopfree(struct jtop_t *top) {
+    int i;
+
+    for (i = 0; i < top->nprocs; i++)
+        jtopclose(&top->procs[i]);
+    free(top->procs);
+    free(top->pids);
+    closedir(top->proc);
+}
+
+/* cmppid - qsort comparison of PIDs */
+int cmppid(const void *a, const void *b) {
+    pid_t x = *(const pid_t *)a, y = *(const pid_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* fmtbytes - Format n bytes in buf in whichever of B, K, M, G or T suits it */
+char *fmtbytes(double n, char *buf, size_t size) {
+    static const char units[] = "BKMGT";
+    int i;
+
+    for (i = 0; n >= 1024 && units[i + 1]; i++)
+        n /= 1024;
+    snprintf(buf, size, i ? "%.1f%c" : "%.0f%c", n, units[i]);
+    return buf;
+}
+
+/*****************
+ * Published job table
+ *
+ * With -S the shell keeps a copy of its job table in shared memory,
+ * laid out as tsh_shm.h describes, so monitors can read the jobs
+ * without scraping jobs or asking the shell anything. Job [i] lives in
+ * slot i, and every change to the job list rewrites its job's slot
+ * under the table's seqlock; a reader that catches the shell writing
+ * just copies again.
+ *****************/
+
+/*
+ * startpublish - Create /dev/shm/tsh-<pid> and start publishing the job
+ *    table there. It's removed when the shell exits. Only the shell's
+ *    user can read it, since it holds their command lines.
+ */
+void startpublish(void) {
+    int flags = O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC;
+    struct stat sb;
+
+    shmpid = getpid();
+    snprintf(shmpath, sizeof(shmpath), TSH_SHM_PATH, shmpid);
+    // The path is predictable, so never follow or reuse what's there,
+    // and only clear away a table some earlier shell of ours left
+    if ((shmfd = open(shmpath, flags, 0600)) < 0 && errno == EEXIST
+            && lstat(shmpath, &sb) == 0 && sb.st_uid == geteuid()
+            && unlink(shmpath) == 0)
+        shmfd = open(shmpath, flags, 0600);
+    if (shmfd < 0) {
+        printf("%s: %s\n", shmpath, strerror(errno));
+        return;
+    }
+    atexit(stoppublish);
+    if (growpublish(64) < 0) {
+        printf("%s: %s\n", shmpath, strerror(errno));
+        return;
+    }
+    // Readers know the table by its magic, so it goes in last
+    shm->version = TSH_SHM_VERSION;
+    shm->hdrsize = sizeof(*shm);
+    shm->jobsize = sizeof(struct tsh_shm_job);
+    shm->pid = shmpid;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(shm->magic, TSH_SHM_MAGIC, sizeof(shm->magic));
+}
+
+/*
+ * growpublish - Make room for nslots slots, mapping the table if it
+ *    isn't yet. Returns 0, or -1 if it can't.
+ */
+int growpublish(int nslots) {
+    size_t size = sizeof(*shm) + nslots * sizeof(struct tsh_shm_job);
+    void *p;
+
+    // The new slots are zeros, which is what free ones hold
+    if (ftruncate(shmfd, size) < 0)
+        return -1;
+    if (!shm)
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shmfd, 0);
+    else
+        p = mremap(shm, shm->size, size, MREMAP_MAYMOVE);
+    if (p == MAP_FAILED)
+        return -1;
+    shm = p;
+    shmlock();
+    shm->size = size;
+    shm->nslots = nslots;
+    shmunlock();
+    return 0;
+}
+
+/* publishjob - Copy job into its slot */
+void publishjob(struct job_t *job) {
+    struct tsh_shm_job *slot;
+    size_t len;
+
+    // A job is published once it has a JID, until removejob takes it off
+    if (!shm || !job->jid || job->state == UNDEF)
+        return;
+    if (job->jid >= (int)shm->nslots && growpublish(jobs->jidcap) < 0)
+        return;
+    slot = (struct tsh_shm_job *)((char *)shm + sizeof(*shm)) + job->jid;
+
+    shmlock();
+    if (!slot->jid) {
+        len = strcspn(job->cmdline, "\n");
+        slot->cmdlen = len;
+        if (len >= TSH_SHM_CMDLEN)
+            len = TSH_SHM_CMDLEN - 1;
+        memcpy(slot->cmdline, job->cmdline, len);
+        slot->cmdline[len] = '\0';
+        shm->started++;
+    }
+    slot->jid = job->jid;
+    slot->pid = job->pid;
+    slot->state = job->state;
+    slot->nprocs = job->nprocs;
+    slot->nlive = job->nlive;
+    slot->status = job->status;
+    slot->start = job->start;
+    slot->utime = job->ru.ru_utime.tv_sec * 1000000000LL + job->ru.ru_utime.tv_usec * 1000LL;
+    slot->stime = job->ru.ru_stime.tv_sec * 1000000000LL + job->ru.ru_stime.tv_usec * 1000LL;
+    slot->maxrss = job->ru.ru_maxrss;
+    publishtotals();
+    shmunlock();
+}
+
+/* unpublishjob - Free job's slot */
+void unpublishjob(struct job_t *job) {
+    struct tsh_shm_job *slot;
+
+    if (!shm || job->jid >= (int)shm->nslots)
+        return;
+    slot = (struct tsh_shm_job *)((char *)shm + sizeof(*shm)) + job->jid;
+    shmlock();
+    if (slot->jid) {
+        slot->jid = 0;
+        shm->finished++;
+    }
+    publishtotals();
+    shmunlock();
+}
+
+/* publishtotals - Update the table's header from the job list */
+void publishtotals(void) {
+    shm->njobs = jobs->njobs;
+    shm->maxjid = jobs->maxjid;
+    shm->fgjid = jobs->fg ? jobs->fg->jid : 0;
+    shm->nbg = jobs->nbg;
+}
+
+/*
+ * shmlock - Start changing the table. seq goes odd before anything
+ *    else does
+ */
+void shmlock(void) {
+    __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/*
+ * shmunlock - Finish changing the table. seq goes even after
+ *    everything else has
+ */
+void shmunlock(void) {
+    __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* stoppublish - Remove the table when the shell exits */
+void stoppublish(void) {
+    // A child that never made it to exec exits through here too
+    if (getpid() == shmpid)
+        unlink(shmpath);
+}
+
+/*****************
+ * Signal handlers
+ *
+ * The shell keeps these signals blocked and receives them through
+ * sigfd, so the handlers below are called synchronously from
+ * handle_signals() and may safely touch the job list and stdio.
  *****************/
 
 /* 
@@ -479,229 +4029,1269 @@ void waitfg(pid_t pid) {
  *     a child job terminates (becomes a zombie), or stops because it
  *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
  *     available zombie children, but doesn't wait for any other
- *     currently running children to terminate.  
+ *     currently running children to terminate.  Pending SIGCHLDs
+ *     coalesce, so one call may reap many children.
  */
 void sigchld_handler(int sig)  {
-    int status;
-    pid_t pid;
+    siginfo_t si;
+    struct rusage ru;
+    TRACE("sigchld", 'i', 0, 0);
+    // Exits of pidfd-tracked children are reaped by reap_pidfd, so
+    // unless someone is untracked we only collect stops here
+    int options = WNOHANG | WSTOPPED;
+    if (!usepidfd || untracked)
+        options |= WEXITED;
+
     while (1){
         // Get status on all stopped and terminated children
-        pid = waitpid(-1, &status, WNOHANG | WUNTRACED);
-        if (pid < 0){
+        si.si_pid = 0;
+        if (waitru(P_ALL, 0, &si, options, &ru) < 0){
             if (errno == ECHILD){
                 // If we're out of children... time to make some more!
+                untracked = 0;
                 return;
             } else if (errno == EINTR){
                 // If we were interrupted, well that's a crying shame. This shouldn't be possible btw
                 continue;
             } else {
                 // ABORT! ABORT MISSION! ABANDON THREAD!!!
-                unix_error("waitpid returned unspecified error.");
+                unix_error("waitid returned unspecified error.");
             }
-        } else if (pid == 0){
+        } else if (si.si_pid == 0){
             // This tells us that nothing's terminated or waiting, I'm pretty sure?
             return;
         }
-        // If the child exited cleanly, just remove it from the pool
-        if (WIFEXITED(status)){
-            //printf("Process %d exited with status %d\n", pid, WEXITSTATUS(status));
-            deletejob(jobs, pid);
-        } else if (WIFSIGNALED(status)){
-            // Let users know if their child was killed
-            printf("Job [%d] (%d) terminated by signal %d\n", getjobpid(jobs, pid)->jid, pid, WTERMSIG(status));
-            deletejob(jobs, pid);
-        } else if (WIFSTOPPED(status)) {
-            // Let users know if their child was stopped
-            printf("Job [%d] (%d) stopped by signal %d\n", getjobpid(jobs, pid)->jid, pid, WSTOPSIG(status));
-            struct job_t *job = getjobpid(jobs, pid);
-            if (job){
-                job->state = ST;
-            }
+        update_job(si.si_pid, wstatus(&si), &ru);
+    }
+    return;
+}
+
+/*
+ * update_job - Apply a waitpid-style status for child pid to the job list,
+ *    charging the job with ru if the child is gone
+ */
+void update_job(pid_t pid, int status, const struct rusage *ru) {
+    struct job_t *job = getjobpid(jobs, pid);
+    struct proc_t *proc;
+
+    if (!job)
+        return;
+    TRACE(WIFSTOPPED(status) ? "stop" : "reap", 'i', job->jid, pid);
+    if (WIFSTOPPED(status)) {
+        // Let users know if their child was stopped, once per job, and
+        // demote it until it's continued
+        if (job->state != ST){
+            postnote(NOTE_STOPPED, job, WSTOPSIG(status));
+            setjobstate(jobs, job, ST);
+            schedjob(job);
         }
+        return;
+    }
+    if (!WIFEXITED(status) && !WIFSIGNALED(status))
+        return;
+
+    // The stage is gone; the last stage decides how the job ended
+    if (!(proc = getproc(job, pid)))
+        return;
+
+    // A parallel job counts its items instead, and starts the next one.
+    // Its leader stays indexed until the group is empty, after which
+    // the kernel may hand the group ID out again
+    if (job->queue) {
+        job->queue->done++;
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+            job->queue->failed++;
+        proc->pid = 0;
+        addrusage(&job->ru, ru);
+        if (pid != job->pid)
+            unindexpid(jobs, pid);
+        if (--job->nlive == 0)
+            unindexpid(jobs, job->pid);
+        publishjob(job);
+        runqueue(job);
+        return;
+    }
+    if (proc == &job->procs[job->nprocs - 1])
+        job->status = status;
+    if (job->perf)
+        perfreap(job, proc - job->procs);
+    proc->pid = 0;
+    addrusage(&job->ru, ru);
+    if (--job->nlive > 0){
+        // Its PID may be recycled while the job lives on. The first
+        // stage's PID is the group ID and can't be, so it stays indexed
+        if (pid != job->pid)
+            unindexpid(jobs, pid);
+        publishjob(job);
+        return;
     }
-    return;
+
+    // Let users know if their child was killed
+    if (WIFSIGNALED(job->status))
+        postnote(NOTE_KILLED, job, WTERMSIG(job->status));
+    if (job->timed){
+        drainnotes();
+        printusage(nsnow() - job->start, &job->ru);
+    }
+    if (job->perf && job->perf->report){
+        drainnotes();
+        perfreport(job);
+    }
+    latrecord(LAT_EXIT, nsnow() - job->launched);
+    if (job->state == FG)
+        fgreaped = nsnow();
+    deletejob(jobs, job->pid);
 }
 
 /* 
  * sigint_handler - The kernel sends a SIGINT to the shell whenver the
  *    user types ctrl-c at the keyboard.  Catch it and send it along
- *    to the foreground job.  
+ *    to the foreground job.  Without one, it interrupts whatever the
+ *    shell is doing itself, like jtop.
  */
 void sigint_handler(int sig) {
     pid_t pid;
     // Move the signal along...
     if ((pid = fgpid(jobs)) > 0){
         // Be sure to send it to the entire process group
-        if (kill(-pid, sig) < 0)
+        if (signaljob(getjobpid(jobs, pid), sig) < 0)
+            unix_error("kill");
+    } else
+        interrupted = 1;    // it's for whatever the shell is doing itself
+}
+
+/*
+ * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
+ *     the user types ctrl-z at the keyboard. Catch it and suspend the
+ *     foreground job by sending it a SIGTSTP.  
+ */
+void sigtstp_handler(int sig) {
+    pid_t pid;
+    // Move the signal along...
+    if ((pid = fgpid(jobs)) > 0){
+        // Be sure to send it to the entire process group
+        if (signaljob(getjobpid(jobs, pid), sig) < 0)
             unix_error("kill");
     }
 }
 
+/*********************
+ * End signal handlers
+ *********************/
+
+/***********************************************
+ * Helper routines that manipulate the job list
+ **********************************************/
+
+/* clearjob - Clear the entries in a job struct */
+void clearjob(struct job_t *job) {
+    job->pid = 0;
+    job->jid = 0;
+    job->state = UNDEF;
+    job->nprocs = job->nlive = 0;
+    job->status = 0;
+    job->procs = NULL;
+    job->next = NULL;
+    job->cmdline = NULL;
+    job->start = 0;
+    memset(&job->ru, 0, sizeof(job->ru));
+    job->timed = 0;
+    job->queue = NULL;
+    job->prio = 0;
+    job->cpus = NULL;
+    job->pinned = 0;
+    job->nice = 0;
+    job->held = 0;
+    job->hist = 0;
+    job->launched = 0;
+    job->perf = NULL;
+}
+
+/* initjobs - Initialize the job list */
+void initjobs(struct joblist_t *jobs) {
+    memset(jobs, 0, sizeof(*jobs));
+}
+
+/* maxjid - Returns largest allocated job ID */
+int maxjid(struct joblist_t *jobs) {
+    return jobs->maxjid;
+}
+
+/* 
+ * hashpid - Return the slot of pid in the PID index, which is either
+ *    the slot holding it or the empty slot where it would go
+ */
+int hashpid(struct joblist_t *jobs, pid_t pid) {
+    int mask = jobs->pidcap - 1;
+    int i = (pid * 2654435761u) & mask;
+
+    while (jobs->bypid[i].pid && jobs->bypid[i].pid != pid)
+        i = (i + 1) & mask;
+    return i;
+}
+
+/* indexpid - Point pid at job in the PID index, growing it as needed */
+void indexpid(struct joblist_t *jobs, pid_t pid, struct job_t *job) {
+    struct pidslot_t *old = jobs->bypid;
+    int i, oldcap = jobs->pidcap;
+
+    // Keep the load factor at or under 1/2 so probes stay short
+    if (2 * (jobs->npids + 1) > jobs->pidcap){
+        jobs->pidcap = oldcap ? 2 * oldcap : 64;
+        if (!(jobs->bypid = calloc(jobs->pidcap, sizeof(*jobs->bypid))))
+            unix_error("calloc error");
+        for (i = 0; i < oldcap; i++)
+            if (old[i].pid)
+                jobs->bypid[hashpid(jobs, old[i].pid)] = old[i];
+        free(old);
+    }
+    i = hashpid(jobs, pid);
+    if (!jobs->bypid[i].pid)
+        jobs->npids++;
+    jobs->bypid[i].pid = pid;
+    jobs->bypid[i].job = job;
+}
+
+/* unindexpid - Drop pid from the PID index */
+void unindexpid(struct joblist_t *jobs, pid_t pid) {
+    int mask = jobs->pidcap - 1;
+    int i, j, k;
+
+    if (!jobs->pidcap || !jobs->bypid[i = hashpid(jobs, pid)].pid)
+        return;
+    // Shift later entries of the probe run back so no lookup breaks
+    for (j = i; ; ){
+        jobs->bypid[i].pid = 0;
+        do {
+            j = (j + 1) & mask;
+            if (!jobs->bypid[j].pid){
+                jobs->npids--;
+                return;
+            }
+            k = (jobs->bypid[j].pid * 2654435761u) & mask;
+        } while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+        jobs->bypid[i] = jobs->bypid[j];
+        i = j;
+    }
+}
+
+/*
+ * setjobstate - Change the state of a job, keeping track of the FG job
+ *    and how many are in the BG state
+ */
+void setjobstate(struct joblist_t *jobs, struct job_t *job, int state) {
+    if (job->state == FG && jobs->fg == job)
+        jobs->fg = NULL;
+    if (job->state == BG)
+        jobs->nbg--;
+    job->state = state;
+    if (state == FG)
+        jobs->fg = job;
+    if (state == BG)
+        jobs->nbg++;
+    publishjob(job);
+}
+
+/* 
+ * addjob - Add a job made of the processes procs to the job list.
+ *    cmdline must come from internline. A PD job has no processes yet
+ */
+int addjob(struct joblist_t *jobs, struct proc_t *procs, int nprocs, int state, char *cmdline) {
+    struct job_t *job;
+    int jid;
+    pid_t pid = nprocs > 0 ? procs[0].pid : 0;
+    
+    if (pid < 1 && state != PD)
+	return 0;
+
+    // Reuse a record from the free list if there is one
+    if ((job = jobs->free))
+        jobs->free = job->next;
+    else if (!(job = malloc(sizeof(*job))))
+        unix_error("malloc error");
+    clearjob(job);
+
+    // Grow the JID index to fit the new job
+    jid = jobs->maxjid + 1;
+    if (jid >= jobs->jidcap){
+        jobs->jidcap = jobs->jidcap ? 2 * jobs->jidcap : 64;
+        if (!(jobs->byjid = realloc(jobs->byjid, jobs->jidcap * sizeof(*jobs->byjid))))
+            unix_error("realloc error");
+        memset(jobs->byjid + jid, 0, (jobs->jidcap - jid) * sizeof(*jobs->byjid));
+    }
+
+    if (nprocs > 0)
+        attachprocs(jobs, job, procs, nprocs);
+    setjobstate(jobs, job, state);
+    job->jid = jid;
+    job->cmdline = holdline(cmdline);
+    job->start = nsnow();
+    job->hist = histpending;
+    histpending = 0;
+    TRACE("job", 'b', job->jid, job->pid);
+
+    jobs->byjid[jid] = job;
+    jobs->maxjid = jid;
+    jobs->njobs++;
+    publishjob(job);
+    if(verbose){
+        printf("Added job [%d] %d %s\n", job->jid, job->pid, job->cmdline);
+    }
+    return 1;
+}
+
+/* attachprocs - Give job a copy of procs and index their PIDs */
+void attachprocs(struct joblist_t *jobs, struct job_t *job, struct proc_t *procs, int nprocs) {
+    int i;
+
+    if (!(job->procs = malloc(nprocs * sizeof(*procs))))
+        unix_error("malloc error");
+    memcpy(job->procs, procs, nprocs * sizeof(*procs));
+    job->nprocs = nprocs;
+    job->pid = procs[0].pid;
+    for (i = 0; i < nprocs; i++)
+        if (procs[i].pid){
+            job->nlive++;
+            indexpid(jobs, procs[i].pid, job);
+        }
+    job->launched = nsnow();
+    publishjob(job);
+}
+
+/*
+ * queuejob - Put a PD job on the pending list behind every job with
+ *    the same or a lower prio
+ */
+void queuejob(struct joblist_t *jobs, struct job_t *job) {
+    struct job_t **pp;
+
+    for (pp = &jobs->pending; *pp && (*pp)->prio <= job->prio; pp = &(*pp)->next)
+        ;
+    job->next = *pp;
+    *pp = job;
+}
+
+/* dequeuejob - Take a job off the pending list */
+void dequeuejob(struct joblist_t *jobs, struct job_t *job) {
+    struct job_t **pp;
+
+    for (pp = &jobs->pending; *pp; pp = &(*pp)->next)
+        if (*pp == job){
+            *pp = job->next;
+            job->next = NULL;
+            return;
+        }
+}
+
+/* deletejob - Delete a job whose PID=pid from the job list */
+int deletejob(struct joblist_t *jobs, pid_t pid) {
+    struct job_t *job;
+
+    if (!(job = getjobpid(jobs, pid)))
+	return 0;
+    removejob(jobs, job);
+    return 1;
+}
+
+/* removejob - Take job off the job list and free what it holds */
+void removejob(struct joblist_t *jobs, struct job_t *job) {
+    int i;
+
+    if (job->state == PD)
+        dequeuejob(jobs, job);
+    holdjob(job, 0);
+
+    // An emptied parallel job's PID isn't indexed, and may now be
+    // someone else's
+    if (getjobpid(jobs, job->pid) == job)
+        unindexpid(jobs, job->pid);
+    for (i = 0; i < job->nprocs; i++)
+        if (job->procs[i].pid)
+            unindexpid(jobs, job->procs[i].pid);
+    setjobstate(jobs, job, UNDEF);
+
+    // The next JID is one past the largest one still in use
+    jobs->byjid[job->jid] = NULL;
+    while (jobs->maxjid > 0 && !jobs->byjid[jobs->maxjid])
+        jobs->maxjid--;
+    jobs->njobs--;
+    unpublishjob(job);
+
+    // A parallel job failed if any of its items did
+    if (job->queue && job->queue->failed)
+        job->status = W_EXITCODE(1, 0);
+    histdone(job->hist, job->status, nsnow() - job->start);
+    TRACE("job", 'e', job->jid, job->pid);
+
+    perffree(job);
+    free(job->procs);
+    free(job->cpus);
+    releaseline(job->cmdline);
+    if (job->queue) {
+        free(job->queue->tmpl);
+        free(job->queue->items);
+        free(job->queue->buf);
+        free(job->queue);
+    }
+    clearjob(job);
+    job->next = jobs->free;
+    jobs->free = job;
+}
+
+/* fgpid - Return PID of current foreground job, 0 if no such job */
+pid_t fgpid(struct joblist_t *jobs) {
+    return jobs->fg ? jobs->fg->pid : 0;
+}
+
+/* getjobpid  - Find a job (by the PID of any of its stages) on the job list */
+struct job_t *getjobpid(struct joblist_t *jobs, pid_t pid) {
+    int i;
+
+    if (pid < 1 || !jobs->pidcap)
+	return NULL;
+    i = hashpid(jobs, pid);
+    return jobs->bypid[i].pid ? jobs->bypid[i].job : NULL;
+}
+
+/* getproc - Find the live stage of a job with PID pid */
+struct proc_t *getproc(struct job_t *job, pid_t pid) {
+    int i;
+
+    for (i = 0; i < job->nprocs; i++)
+	if (job->procs[i].pid == pid)
+	    return &job->procs[i];
+    return NULL;
+}
+
+/* getjobjid  - Find a job (by JID) on the job list */
+struct job_t *getjobjid(struct joblist_t *jobs, int jid) {
+    if (jid < 1 || jid > jobs->maxjid)
+	return NULL;
+    return jobs->byjid[jid];
+}
+
+/* pid2jid - Map process ID to job ID */
+int pid2jid(pid_t pid) {
+    struct job_t *job = getjobpid(jobs, pid);
+
+    return job ? job->jid : 0;
+}
+
+/* listjobs - Print the job list */
+void listjobs(struct joblist_t *jobs) {
+    struct job_t *job;
+    int i;
+    
+    for (i = 1; i <= jobs->maxjid; i++) {
+        if ((job = jobs->byjid[i]) != NULL) {
+            printf("[%d] (%d) ", job->jid, job->pid);
+            switch (job->state) {
+            case BG:
+                printf("Running ");
+                break;
+            case FG:
+                printf("Foreground ");
+                break;
+            case ST:
+                printf(job->held ? "Stopped (pressure) " : "Stopped ");
+                break;
+            case PD:
+                printf("Pending ");
+                break;
+            default:
+                printf("listjobs: Internal error: job[%d].state=%d ",
+                   i, job->state);
+            }
+            printf("%s", job->cmdline);
+        }
+    }
+}
+/*
+ * memjobs - Report how much memory the job list is using. cmdline is
+ *    the interned line of the command asking, which isn't counted
+ *    unless a job shares it
+ */
+void memjobs(struct joblist_t *jobs, char *cmdline) {
+    struct linestr_t *self = (struct linestr_t *)(cmdline - offsetof(struct linestr_t, text));
+    struct job_t *job;
+    size_t recs, procs = 0, lines = linepool.bytes;
+    int i, nlines = linepool.nlines;
+
+    for (i = 1; i <= jobs->maxjid; i++)
+        if ((job = jobs->byjid[i]) != NULL)
+            procs += job->nprocs * sizeof(struct proc_t);
+    recs = jobs->njobs * sizeof(struct job_t);
+    if (self->refs == 1){
+        lines -= sizeof(*self) + strlen(self->text) + 1;
+        nlines--;
+    }
+    printf("%d jobs: %zu bytes of records, %zu of stages, "
+           "%zu in %d distinct command lines\n",
+           jobs->njobs, recs, procs, lines, nlines);
+    if (jobs->njobs)
+        printf("%zu bytes per job\n", (recs + procs + lines) / jobs->njobs);
+}
+
+/*
+ * internline - Return a pooled copy of line. Identical lines share one
+ *    copy, sized to fit, which lives until releaseline drops the last
+ *    reference to it
+ */
+char *internline(const char *line) {
+    struct linestr_t *entry, **old = linepool.buckets;
+    size_t len = strlen(line), k;
+    unsigned h = 5381;
+    int i, oldsize = linepool.nbuckets;
+
+    for (k = 0; k < len; k++)
+        h = h * 33 + (unsigned char)line[k];
+    for (entry = linepool.nbuckets ? linepool.buckets[h & (linepool.nbuckets - 1)] : NULL;
+         entry; entry = entry->next){
+        if (entry->hash == h && !strcmp(entry->text, line)){
+            entry->refs++;
+            return entry->text;
+        }
+    }
+
+    // Double the buckets once the chains average more than one line
+    if (linepool.nlines >= linepool.nbuckets){
+        linepool.nbuckets = oldsize ? 2 * oldsize : 64;
+        if (!(linepool.buckets = calloc(linepool.nbuckets, sizeof(*linepool.buckets))))
+            unix_error("calloc error");
+        for (i = 0; i < oldsize; i++){
+            while ((entry = old[i]) != NULL){
+                old[i] = entry->next;
+                entry->next = linepool.buckets[entry->hash & (linepool.nbuckets - 1)];
+                linepool.buckets[entry->hash & (linepool.nbuckets - 1)] = entry;
+            }
+        }
+        free(old);
+    }
+
+    if (!(entry = malloc(sizeof(*entry) + len + 1)))
+        unix_error("malloc error");
+    memcpy(entry->text, line, len + 1);
+    entry->hash = h;
+    entry->refs = 1;
+    entry->next = linepool.buckets[h & (linepool.nbuckets - 1)];
+    linepool.buckets[h & (linepool.nbuckets - 1)] = entry;
+    linepool.nlines++;
+    linepool.bytes += sizeof(*entry) + len + 1;
+    return entry->text;
+}
+
+/* holdline - Take another reference to a line returned by internline */
+char *holdline(char *line) {
+    ((struct linestr_t *)(line - offsetof(struct linestr_t, text)))->refs++;
+    return line;
+}
+
+/* releaseline - Drop a reference to a line returned by internline */
+void releaseline(char *line) {
+    struct linestr_t *entry, **link;
+
+    if (!line)
+        return;
+    entry = (struct linestr_t *)(line - offsetof(struct linestr_t, text));
+    if (--entry->refs > 0)
+        return;
+    for (link = &linepool.buckets[entry->hash & (linepool.nbuckets - 1)];
+         *link != entry; link = &(*link)->next)
+        ;
+    *link = entry->next;
+    linepool.nlines--;
+    linepool.bytes -= sizeof(*entry) + strlen(entry->text) + 1;
+    free(entry);
+}
+
+/*
+ * listusage - Print the job list with the resources each job has used:
+ *    CPU time, the largest RSS of any stage, page faults and context
+ *    switches. Live stages are read from /proc.
+ */
+void listusage(struct joblist_t *jobs) {
+    static const char *states[] = {"Undefined", "Foreground", "Running", "Stopped", "Pending"};
+    struct job_t *job;
+    struct rusage ru, live;
+    long long now = nsnow();
+    int i, j;
+
+    for (i = 1; i <= jobs->maxjid; i++) {
+        if ((job = jobs->byjid[i]) == NULL)
+            continue;
+        ru = job->ru;
+        for (j = 0; j < job->nprocs; j++)
+            if (job->procs[j].pid && procusage(job->procs[j].pid, &live) == 0)
+                addrusage(&ru, &live);
+        printf("[%d] (%d) %s ", job->jid, job->pid, states[job->state]);
+        printusage(now - job->start, &ru);
+        printf("    %s", job->cmdline);
+    }
+}
+
+/* nsnow - Return the CLOCK_MONOTONIC time in nanoseconds */
+long long nsnow(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* addrusage - Charge ru to sum; RSS is the largest of the two, not a sum */
+void addrusage(struct rusage *sum, const struct rusage *ru) {
+    timeradd(&sum->ru_utime, &ru->ru_utime, &sum->ru_utime);
+    timeradd(&sum->ru_stime, &ru->ru_stime, &sum->ru_stime);
+    if (ru->ru_maxrss > sum->ru_maxrss)
+        sum->ru_maxrss = ru->ru_maxrss;
+    sum->ru_minflt += ru->ru_minflt;
+    sum->ru_majflt += ru->ru_majflt;
+    sum->ru_nvcsw += ru->ru_nvcsw;
+    sum->ru_nivcsw += ru->ru_nivcsw;
+}
+
+/*
+ * procusage - Fill in ru for a live process from /proc, counting its
+ *    reaped children like wait does. Returns -1 if it's gone.
+ */
+int procusage(pid_t pid, struct rusage *ru) {
+    static long hz;
+    char path[64], buf[1024], *p;
+    unsigned long minflt, cminflt, majflt, cmajflt, utime, stime;
+    long cutime, cstime;
+    FILE *fp;
+    int fd, n;
+
+    if (!hz)
+        hz = sysconf(_SC_CLK_TCK);
+    memset(ru, 0, sizeof(*ru));
+
+    // The command name can hold anything, so parse from its closing paren
+    sprintf(path, "/proc/%d/stat", pid);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0 || !(p = strrchr((buf[n] = '\0', buf), ')')))
+        return -1;
+    if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %lu %lu %lu %lu %lu %lu %ld %ld",
+               &minflt, &cminflt, &majflt, &cmajflt, &utime, &stime, &cutime, &cstime) != 8)
+        return -1;
+    ru->ru_minflt = minflt + cminflt;
+    ru->ru_majflt = majflt + cmajflt;
+    ru->ru_utime.tv_sec = (utime + cutime) / hz;
+    ru->ru_utime.tv_usec = (utime + cutime) % hz * 1000000 / hz;
+    ru->ru_stime.tv_sec = (stime + cstime) / hz;
+    ru->ru_stime.tv_usec = (stime + cstime) % hz * 1000000 / hz;
+
+    sprintf(path, "/proc/%d/status", pid);
+    if ((fp = fopen(path, "re")) != NULL) {
+        while (fgets(buf, sizeof(buf), fp)) {
+            if (!strncmp(buf, "VmHWM:", 6))
+                ru->ru_maxrss = atol(buf + 6);
+            else if (!strncmp(buf, "voluntary_ctxt_switches:", 24))
+                ru->ru_nvcsw = atol(buf + 24);
+            else if (!strncmp(buf, "nonvoluntary_ctxt_switches:", 27))
+                ru->ru_nivcsw = atol(buf + 27);
+        }
+        fclose(fp);
+    }
+    return 0;
+}
+
+/* printusage - Print ns of wall-clock time and the resources in ru */
+void printusage(long long ns, const struct rusage *ru) {
+    printf("real %lld.%09llds user %ld.%06lds sys %ld.%06lds "
+           "maxrss %ldK faults %ld/%ld csw %ld/%ld\n",
+           ns / 1000000000, ns % 1000000000,
+           (long)ru->ru_utime.tv_sec, (long)ru->ru_utime.tv_usec,
+           (long)ru->ru_stime.tv_sec, (long)ru->ru_stime.tv_usec,
+           ru->ru_maxrss, ru->ru_minflt, ru->ru_majflt,
+           ru->ru_nvcsw, ru->ru_nivcsw);
+}
+
+/******************************
+ * end job list helper routines
+ ******************************/
+
+
+/*************************************************
+ * Helper routines that manipulate the command hash
+ *************************************************/
+
+/*
+ * findcmd - Return the file to execute for command name. Names with a
+ *    slash are used as they are; anything else is searched for on PATH
+ *    once and remembered, misses included, until PATH or one of its
+ *    directories changes. Returns NULL if name isn't on PATH.
+ */
+char *findcmd(char *name) {
+    struct cmdhash_t *entry;
+    const char *path;
+    unsigned h = 5381;
+    char *c, buf[4096];
+
+    if (strchr(name, '/'))
+        return name;
+
+    // Lines already buffered run without a trip through the event
+    // loop, so look for directory events here as well
+    if (inotifyfd >= 0 && read(inotifyfd, buf, sizeof(buf)) > 0)
+        clearhash();
+
+    // Start over if PATH isn't what the hash was built for
+    if (!(path = getenv("PATH")))
+        path = "/bin:/usr/bin";
+    if (!hashpath || strcmp(hashpath, path)){
+        clearhash();
+        free(hashpath);
+        hashpath = strdup(path);
+        watchpath(path);
+    }
+
+    for (c = name; *c; c++)
+        h = h * 33 + (unsigned char)*c;
+    for (entry = cmdhash[h & (HASHSIZE - 1)]; entry; entry = entry->next){
+        if (!strcmp(entry->name, name)){
+            entry->hits++;
+            return entry->path;
+        }
+    }
+
+    if (!(entry = malloc(sizeof(*entry))))
+        unix_error("malloc error");
+    entry->name = strdup(name);
+    entry->path = searchpath(path, name);
+    entry->hits = 1;
+    entry->next = cmdhash[h & (HASHSIZE - 1)];
+    cmdhash[h & (HASHSIZE - 1)] = entry;
+    return entry->path;
+}
+
+/*
+ * searchpath - Walk the directories of path for an executable regular
+ *    file called name. Returns a malloc'd path, or NULL.
+ */
+char *searchpath(const char *path, const char *name) {
+    struct stat sb;
+    const char *dir = path, *end;
+    char *file;
+    size_t dirlen, namelen = strlen(name);
+
+    while (1){
+        end = strchrnul(dir, ':');
+        // An empty entry means the current directory
+        dirlen = end - dir;
+        if (!(file = malloc(dirlen + namelen + 3)))
+            unix_error("malloc error");
+        if (dirlen == 0)
+            strcpy(file, ".");
+        else
+            memcpy(file, dir, dirlen), file[dirlen] = '\0';
+        strcat(file, "/");
+        strcat(file, name);
+        if (!stat(file, &sb) && S_ISREG(sb.st_mode) && !access(file, X_OK))
+            return file;
+        free(file);
+        if (!*end)
+            return NULL;
+        dir = end + 1;
+    }
+}
+
+/* clearhash - Forget every remembered command location */
+void clearhash(void) {
+    struct cmdhash_t *entry, *next;
+    char buf[4096];
+    int i;
+
+    // Swallow pending directory events; they are all covered now
+    if (inotifyfd >= 0)
+        while (read(inotifyfd, buf, sizeof(buf)) > 0)
+            ;
+    for (i = 0; i < HASHSIZE; i++){
+        for (entry = cmdhash[i]; entry; entry = next){
+            next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+        cmdhash[i] = NULL;
+    }
+}
+
+/*
+ * watchpath - Watch every directory on path, so that installing or
+ *    removing a program there clears the command hash from the event
+ *    loop. Without inotify the hash only follows changes to PATH itself.
+ */
+void watchpath(const char *path) {
+    struct epoll_event ev;
+    const char *dir = path, *end;
+    char name[PATH_MAX];
+    size_t len;
+
+    if (inotifyfd >= 0)
+        close(inotifyfd);
+    if ((inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+        return;
+    ev.events = EPOLLIN;
+    ev.data.u64 = inotifyfd;
+    if (epoll_ctl(evfd, EPOLL_CTL_ADD, inotifyfd, &ev) < 0){
+        close(inotifyfd);
+        inotifyfd = -1;
+        return;
+    }
+
+    while (1){
+        end = strchrnul(dir, ':');
+        len = end - dir;
+        if (len == 0)
+            strcpy(name, ".");
+        else if (len < sizeof(name))
+            memcpy(name, dir, len), name[len] = '\0';
+        else
+            name[0] = '\0';
+        if (name[0])
+            inotify_add_watch(inotifyfd, name, IN_CREATE | IN_DELETE | IN_ATTRIB
+                    | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+        if (!*end)
+            return;
+        dir = end + 1;
+    }
+}
+
+/* listhash - Print the command hash */
+void listhash(void) {
+    struct cmdhash_t *entry;
+    int i, empty = 1;
+
+    for (i = 0; i < HASHSIZE; i++){
+        for (entry = cmdhash[i]; entry; entry = entry->next){
+            if (empty)
+                printf("hits\tcommand\n");
+            empty = 0;
+            if (entry->path)
+                printf("%4d\t%s\n", entry->hits, entry->path);
+            else
+                printf("%4d\t%s (not found)\n", entry->hits, entry->name);
+        }
+    }
+    if (empty)
+        printf("hash: hash table empty\n");
+}
+/******************************
+ * end command hash helper routines
+ ******************************/
+
+
+/*************************************************
+ * Helper routines that place and schedule jobs on CPUs
+ *************************************************/
+
+/*
+ * initcpus - Note the CPUs the shell may run on. Jobs are only ever
+ *    placed within them
+ */
+void initcpus(void) {
+    if (sched_getaffinity(0, sizeof(shellcpus), &shellcpus) == 0)
+        ncpus = CPU_COUNT(&shellcpus);
+}
+
+/*
+ * pickcpus - Return a malloc'd set of the n least loaded CPUs for a BG
+ *    job, or NULL if that would be every CPU it could have anyway. The
+ *    load on a CPU is the number of BG jobs placed on it. fgcpu is left
+ *    out unless it's the only one, even if that leaves fewer than n.
+ */
+cpu_set_t *pickcpus(int n) {
+    int load[CPU_SETSIZE] = {0};
+    int avail = ncpus, i, c, best;
+    struct job_t *job;
+    cpu_set_t *cpus;
+
+    if (fgcpu >= 0 && ncpus > 1)
+        avail--;
+    if (n < 1 || (n >= avail && avail == ncpus))
+        return NULL;
+    if (n > avail)
+        n = avail;
+
+    for (i = 1; i <= jobs->maxjid; i++)
+        if ((job = jobs->byjid[i]) && job->state == BG && job->cpus)
+            for (c = 0; c < CPU_SETSIZE; c++)
+                if (CPU_ISSET(c, job->cpus))
+                    load[c]++;
+
+    if (!(cpus = malloc(sizeof(*cpus))))
+        unix_error("malloc error");
+    CPU_ZERO(cpus);
+    while (n-- > 0){
+        for (best = -1, c = 0; c < CPU_SETSIZE; c++)
+            if (CPU_ISSET(c, &shellcpus) && !CPU_ISSET(c, cpus) &&
+                (c != fgcpu || ncpus == 1) && (best < 0 || load[c] < load[best]))
+                best = c;
+        CPU_SET(best, cpus);
+    }
+    return cpus;
+}
+
+/*
+ * placejob - Move a job that has just changed state to where its state
+ *    says it belongs: the least loaded CPUs for BG, all of them for FG.
+ *    Jobs pinned by hand stay put, and parallel jobs, which spread
+ *    themselves over the CPUs, aren't placed.
+ */
+void placejob(struct job_t *job) {
+    if (job->pinned || job->queue)
+        return;
+    if (job->state == BG && !job->cpus)
+        pinjob(job, pickcpus(job->nlive));
+    else if (job->state == FG && job->cpus)
+        pinjob(job, NULL);
+}
+
 /*
- * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
- *     the user types ctrl-z at the keyboard. Catch it and suspend the
- *     foreground job by sending it a SIGTSTP.  
+ * pinjob - Pin every live stage of job to cpus (NULL for shellcpus),
+ *    which the job takes over
  */
-void sigtstp_handler(int sig) {
-    pid_t pid;
-    // Move the signal along...
-    if ((pid = fgpid(jobs)) > 0){
-        // Be sure to send it to the entire process group
-        if (kill(-pid, sig) < 0)
-            unix_error("kill");
-    }
+void pinjob(struct job_t *job, cpu_set_t *cpus) {
+    int i;
+
+    if (job->cpus != cpus)
+        free(job->cpus);
+    job->cpus = cpus;
+    for (i = 0; i < job->nprocs; i++)
+        if (job->procs[i].pid)
+            pinpid(job->procs[i].pid, cpus ? cpus : &shellcpus);
 }
 
-/*********************
- * End signal handlers
- *********************/
+/* pintid - Set the affinity of thread tid to the cpu_set_t at arg */
+int pintid(pid_t tid, const void *arg) {
+    return sched_setaffinity(tid, sizeof(cpu_set_t), arg);
+}
 
-/***********************************************
- * Helper routines that manipulate the job list
- **********************************************/
+/*
+ * pinpid - Set the affinity of every thread of process pid. Its
+ *    children are left alone; they got their affinity when they
+ *    started. Returns -1 if the process couldn't be pinned.
+ */
+int pinpid(pid_t pid, const cpu_set_t *cpus) {
+    int rc = pintid(pid, cpus);
 
-/* clearjob - Clear the entries in a job struct */
-void clearjob(struct job_t *job) {
-    job->pid = 0;
-    job->jid = 0;
-    job->state = UNDEF;
-    job->cmdline[0] = '\0';
+    eachthread(pid, pintid, cpus);
+    return rc;
 }
 
-/* initjobs - Initialize the job list */
-void initjobs(struct job_t *jobs) {
+/* schedtid - Set the scheduling policy of thread tid to the int at arg */
+int schedtid(pid_t tid, const void *arg) {
+    struct sched_param param = {0};
+
+    return sched_setscheduler(tid, *(const int *)arg, &param);
+}
+
+/*
+ * schedjob - Set the scheduling of a job from its state. FG jobs get
+ *    the normal policy and I/O class. BG and stopped ones go to
+ *    SCHED_BATCH, which is never preferred over a FG job waking up,
+ *    and to the idle I/O class. SCHED_IDLE would be stronger, but
+ *    an unprivileged shell can't take a job back out of it.
+ *    The nice level and I/O class are set for the whole process
+ *    group, children included.
+ */
+void schedjob(struct job_t *job) {
+    int policy = job->state == FG ? SCHED_OTHER : SCHED_BATCH;
+    int ioclass = job->state == FG ? IOPRIO_CLASS_NONE : IOPRIO_CLASS_IDLE;
     int i;
 
-    for (i = 0; i < MAXJOBS; i++)
-	clearjob(&jobs[i]);
+    if (!job->nlive)
+        return;
+    for (i = 0; i < job->nprocs; i++)
+        if (job->procs[i].pid){
+            schedtid(job->procs[i].pid, &policy);
+            eachthread(job->procs[i].pid, schedtid, &policy);
+        }
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PGRP, job->pid, ioclass << IOPRIO_CLASS_SHIFT);
+    if (job->nice && setpriority(PRIO_PGRP, job->pid, job->nice) < 0 && errno == EACCES)
+        printf("nice: [%d] (%d): %s\n", job->jid, job->pid, strerror(errno));
 }
 
-/* maxjid - Returns largest allocated job ID */
-int maxjid(struct job_t *jobs) {
-    int i, max=0;
+/*
+ * eachthread - Call fn(tid, arg) for every thread of process pid but
+ *    the main one, whose TID is pid
+ */
+void eachthread(pid_t pid, int (*fn)(pid_t tid, const void *arg), const void *arg) {
+    char path[64];
+    struct dirent *ent;
+    DIR *dir;
 
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].jid > max)
-	    max = jobs[i].jid;
-    return max;
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    if (!(dir = opendir(path)))
+        return;
+    while ((ent = readdir(dir)))
+        if (*ent->d_name != '.' && atoi(ent->d_name) != pid)
+            fn(atoi(ent->d_name), arg);
+    closedir(dir);
 }
 
-/* addjob - Add a job to the job list */
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline) {
-    int i;
-    
-    if (pid < 1)
-	return 0;
+/*
+ * bindshell - Set the shell's own affinity to cpus (NULL for shellcpus)
+ *    so that the children it starts next inherit it
+ */
+void bindshell(const cpu_set_t *cpus) {
+    sched_setaffinity(0, sizeof(*cpus), cpus ? cpus : &shellcpus);
+}
 
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid == 0) {
-            jobs[i].pid = pid;
-            jobs[i].state = state;
-            jobs[i].jid = nextjid++;
-            if (nextjid > MAXJOBS)
-            nextjid = 1;
-            strcpy(jobs[i].cmdline, cmdline);
-            if(verbose){
-                printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
-            }
-            return 1;
+/*
+ * parsecpus - Parse a CPU list like 0-3,6 into cpus. Returns -1 if it
+ *    isn't one.
+ */
+int parsecpus(const char *list, cpu_set_t *cpus) {
+    const char *p = list;
+    char *end;
+    long lo, hi;
+
+    CPU_ZERO(cpus);
+    do {
+        lo = hi = strtol(p, &end, 10);
+        if (end == p || lo < 0)
+            return -1;
+        if (*end == '-'){
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p || hi < lo)
+                return -1;
+        }
+        if (hi >= CPU_SETSIZE)
+            return -1;
+        for (; lo <= hi; lo++)
+            CPU_SET(lo, cpus);
+        p = end + 1;
+    } while (*end == ',');
+    return *end ? -1 : 0;
+}
+
+/* formatcpus - Write cpus into buf as a CPU list like 0-3,6 */
+char *formatcpus(const cpu_set_t *cpus, char *buf, size_t size) {
+    size_t len = 0;
+    int lo, hi;
+
+    buf[0] = '\0';
+    for (lo = 0; lo < CPU_SETSIZE && len < size; lo = hi + 1){
+        if (!CPU_ISSET(lo, cpus)){
+            hi = lo;
+            continue;
         }
+        for (hi = lo; hi + 1 < CPU_SETSIZE && CPU_ISSET(hi + 1, cpus); hi++)
+            ;
+        if (hi == lo)
+            len += snprintf(buf + len, size - len, "%s%d", len ? "," : "", lo);
+        else
+            len += snprintf(buf + len, size - len, "%s%d-%d", len ? "," : "", lo, hi);
     }
-    printf("Tried to create too many jobs\n");
-    return 0;
+    return buf;
 }
+/******************************
+ * end CPU placement and scheduling helper routines
+ ******************************/
 
-/* deletejob - Delete a job whose PID=pid from the job list */
-int deletejob(struct job_t *jobs, pid_t pid) {
-    int i;
 
-    if (pid < 1)
-	return 0;
+/*************************************************
+ * Helper routines for the pressure governor
+ *************************************************/
+
+/*
+ * startgovernor - (Re)arm a PSI trigger for every resource with a limit
+ *    and watch them from the event loop. The kernel wakes us with
+ *    EPOLLPRI at most once a window while a trigger is over its limit.
+ *    Returns -1 if there's no PSI.
+ */
+int startgovernor(void) {
+    struct epoll_event ev;
+    char path[64], trigger[64];
+    int i, fd;
 
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid == pid) {
-            clearjob(&jobs[i]);
-            nextjid = maxjid(jobs)+1;
-            return 1;
+    closetriggers();
+    if (govtimer < 0 &&
+        (govtimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) >= 0){
+        ev.events = EPOLLIN;
+        ev.data.u64 = govtimer;
+        epoll_ctl(evfd, EPOLL_CTL_ADD, govtimer, &ev);
+    }
+    for (i = 0; i < NPSI; i++){
+        if (!psi[i].limit)
+            continue;
+        snprintf(path, sizeof(path), "/proc/pressure/%s", psi[i].name);
+        snprintf(trigger, sizeof(trigger), "some %d %d",
+                 psi[i].limit * PSIWINDOW * 10000, PSIWINDOW * 1000000);
+        if ((fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0 ||
+            write(fd, trigger, strlen(trigger) + 1) < 0){
+            if (fd >= 0)
+                close(fd);
+            closetriggers();
+            return -1;
         }
+        ev.events = EPOLLPRI;
+        ev.data.u64 = fd;
+        if (epoll_ctl(evfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            unix_error("epoll_ctl error");
+        psi[i].fd = fd;
     }
+    governing = 1;
+    govnote("on: memory %d%%, cpu %d%%, io %d%%", psi[0].limit, psi[1].limit, psi[2].limit);
     return 0;
 }
 
-/* fgpid - Return PID of current foreground job, 0 if no such job */
-pid_t fgpid(struct job_t *jobs) {
+/* stopgovernor - Stop watching pressure and continue every held job */
+void stopgovernor(void) {
+    struct job_t *job;
     int i;
 
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].state == FG)
-	    return jobs[i].pid;
-    return 0;
+    closetriggers();
+    for (i = 1; i <= jobs->maxjid && nheld; i++)
+        if ((job = jobs->byjid[i]) && job->held){
+            govnote("off: continuing [%d] (%d) %s", job->jid, job->pid, job->cmdline);
+            resumejob(job);
+        }
+    if (governing)
+        govnote("off");
+    governing = 0;
 }
 
-/* getjobpid  - Find a job (by PID) on the job list */
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
+/* closetriggers - Close every PSI trigger (which takes it out of evfd) */
+void closetriggers(void) {
     int i;
 
-    if (pid < 1)
-	return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].pid == pid)
-	    return &jobs[i];
-    return NULL;
+    for (i = 0; i < NPSI; i++)
+        if (psi[i].fd >= 0){
+            close(psi[i].fd);
+            psi[i].fd = -1;
+        }
 }
 
-/* getjobjid  - Find a job (by JID) on the job list */
-struct job_t *getjobjid(struct job_t *jobs, int jid) {
+/*
+ * govern - Handle a PSI trigger: res has been over its limit for a
+ *    window, so stop the BG job that matters least, which is the
+ *    one with the highest nice level and, among those, the newest.
+ *    The kernel smooths a window's stalls over the next one, so for two
+ *    windows after a stop the stalls are still from before it.
+ */
+void govern(struct psi_t *res) {
+    struct job_t *job, *victim = NULL;
+    long long now = nsnow();
     int i;
 
-    if (jid < 1)
-	return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].jid == jid)
-	    return &jobs[i];
-    return NULL;
+    if (now - govstop < 2 * PSIWINDOW * 1000000000LL)
+        return;
+    for (i = jobs->maxjid; i > 0; i--)
+        if ((job = jobs->byjid[i]) && job->state == BG && !job->held &&
+            (!victim || job->nice > victim->nice))
+            victim = job;
+    if (!victim)
+        return;
+    govnote("%s stalls over %d%% (avg10 %.2f%%): stopping [%d] (%d) %s", res->name,
+            res->limit, psiavg(res), victim->jid, victim->pid, victim->cmdline);
+    holdjob(victim, 1);
+    govstop = now;
 }
 
-/* pid2jid - Map process ID to job ID */
-int pid2jid(pid_t pid) {
+/*
+ * govtick - Every window while jobs are held, continue the one that
+ *    matters most if every watched resource is below half its limit.
+ *    avg10 lags, so the last stop gets a few windows to show first.
+ */
+void govtick(void) {
+    struct job_t *job, *best = NULL;
+    uint64_t ticks;
     int i;
 
-    if (pid < 1)
-	return 0;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].pid == pid) {
-        return jobs[i].jid;
+    if (read(govtimer, &ticks, sizeof(ticks)) < 0 ||
+        nsnow() - govstop < 3 * PSIWINDOW * 1000000000LL)
+        return;
+    for (i = 0; i < NPSI; i++)
+        if (psi[i].fd >= 0 && psiavg(&psi[i]) * 2 >= psi[i].limit)
+            return;
+    for (i = 1; i <= jobs->maxjid; i++)
+        if ((job = jobs->byjid[i]) && job->held && (!best || job->nice < best->nice))
+            best = job;
+    if (!best)
+        return;
+    govnote("pressure is down: continuing [%d] (%d) %s", best->jid, best->pid, best->cmdline);
+    resumejob(best);
+}
+
+/*
+ * holdjob - Stop a BG job for the governor (hold set), or stop holding
+ *    one (hold clear) without continuing it. The timer only runs while
+ *    something is held.
+ */
+void holdjob(struct job_t *job, int hold) {
+    struct itimerspec its = {{PSIWINDOW, 0}, {PSIWINDOW, 0}};
+
+    if (hold == job->held)
+        return;
+    job->held = hold;
+    if (hold){
+        signaljob(job, SIGSTOP);
+        if (nheld++ == 0)
+            timerfd_settime(govtimer, 0, &its, NULL);
+        return;
+    }
+    if (--nheld == 0){
+        memset(&its, 0, sizeof(its));
+        timerfd_settime(govtimer, 0, &its, NULL);
     }
-    return 0;
 }
 
-/* listjobs - Print the job list */
-void listjobs(struct job_t *jobs) {
-    int i;
-    
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid != 0) {
-            printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
-            switch (jobs[i].state) {
-            case BG:
-                printf("Running ");
-                break;
-            case FG:
-                printf("Foreground ");
-                break;
-            case ST:
-                printf("Stopped ");
-                break;
-            default:
-                printf("listjobs: Internal error: job[%d].state=%d ",
-                   i, jobs[i].state);
-            }
-            printf("%s", jobs[i].cmdline);
-        }
+/*
+ * resumejob - Let a held job go, and run it in the BG again. It may
+ *    not have been seen to stop yet; continuing it cancels the stop.
+ */
+void resumejob(struct job_t *job) {
+    holdjob(job, 0);
+    if (job->state == BG)
+        signaljob(job, SIGCONT);
+    else if (job->state == ST){
+        signaljob(job, SIGCONT);
+        setjobstate(jobs, job, BG);
+        placejob(job);
+        schedjob(job);
+    }
+}
+
+/* psiavg - Return the "some avg10" pressure on res as a percentage */
+double psiavg(struct psi_t *res) {
+    char path[64], buf[256];
+    double avg = 0;
+    int fd, n;
+
+    snprintf(path, sizeof(path), "/proc/pressure/%s", res->name);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return 0;
+    if ((n = read(fd, buf, sizeof(buf) - 1)) > 0){
+        buf[n] = '\0';
+        sscanf(buf, "some avg10=%lf", &avg);
     }
+    close(fd);
+    return avg;
+}
+
+/* govnote - Log a governor decision, and tell the user about it */
+void govnote(const char *fmt, ...) {
+    char *entry = govlog[ngovlog++ % GOVLOG];
+    time_t now = time(NULL);
+    size_t len;
+    va_list ap;
+
+    len = strftime(entry, sizeof(govlog[0]), "%H:%M:%S ", localtime(&now));
+    va_start(ap, fmt);
+    vsnprintf(entry + len, sizeof(govlog[0]) - len, fmt, ap);
+    va_end(ap);
+    // Command lines end in a newline; the log doesn't want it
+    entry[strcspn(entry, "\n")] = '\0';
+    printf("governor: %s\n", entry + len);
 }
 /******************************
- * end job list helper routines
+ * end pressure governor helper routines
  ******************************/
 
 
@@ -713,10 +5303,14 @@ void listjobs(struct job_t *jobs) {
  * usage - print a help message
  */
 void usage(void) {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvpfS] [-T trace.json] [-c commands | script]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -f   launch jobs with fork instead of posix_spawn\n");
+    printf("   -c   run commands (one per line) and exit\n");
+    printf("   -T   trace job lifecycles, saving Chrome trace JSON on exit\n");
+    printf("   -S   publish the job table in /dev/shm/tsh-<pid> for monitors\n");
     exit(1);
 }
 
@@ -739,19 +5333,485 @@ void app_error(char *msg)
 }
 
 /*
- * Signal - wrapper for the sigaction function
+ * initevents - Block the job control signals, route them through sigfd
+ *    and build the epoll sets the shell waits on
+ */
+void initevents(void)
+{
+    sigset_t mask, pipemask;
+    struct epoll_event ev;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);  /* Terminated or stopped child */
+    sigaddset(&mask, SIGINT);   /* ctrl-c */
+    sigaddset(&mask, SIGTSTP);  /* ctrl-z */
+    sigaddset(&mask, SIGQUIT);  /* a clean way to kill the shell */
+    if (sigprocmask(SIG_BLOCK, &mask, &child_mask) < 0)
+        unix_error("sigprocmask error");
+
+    // Utilities run in the shell may write to a pipe no one reads any
+    // more, and that should fail with EPIPE rather than kill the shell.
+    // Children get child_mask, which doesn't have it
+    sigemptyset(&pipemask);
+    sigaddset(&pipemask, SIGPIPE);
+    if (sigprocmask(SIG_BLOCK, &pipemask, NULL) < 0)
+        unix_error("sigprocmask error");
+    if ((sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+        unix_error("signalfd error");
+
+    if ((evfd = epoll_create1(EPOLL_CLOEXEC)) < 0
+            || (replfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        unix_error("epoll_create1 error");
+
+    // Fall back to reaping everything from SIGCHLD without pidfds
+    int fd = syscall(SYS_pidfd_open, getpid(), 0);
+    if (fd < 0)
+        usepidfd = 0;
+    else
+        close(fd);
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = sigfd;
+    if (epoll_ctl(evfd, EPOLL_CTL_ADD, sigfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    ev.data.u64 = 0;
+    ev.data.fd = evfd;
+    if (epoll_ctl(replfd, EPOLL_CTL_ADD, evfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    ev.data.fd = STDIN_FILENO;
+    if (epoll_ctl(replfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) < 0) {
+        // Regular files are always readable and can't be polled
+        if (errno != EPERM)
+            unix_error("epoll_ctl error");
+        stdin_pollable = 0;
+    }
+}
+
+/*
+ * dispatch_events - Wait up to timeout ms (-1 forever) for job events
+ *    and handle everything that is ready
+ */
+void dispatch_events(int timeout)
+{
+    struct epoll_event ev[MAXEVENTS];
+    int i, j, n, fd;
+
+    if ((n = epoll_wait(evfd, ev, MAXEVENTS, timeout)) < 0) {
+        if (errno == EINTR)
+            return;
+        unix_error("epoll_wait error");
+    }
+    for (i = 0; i < n; i++) {
+        // data holds the fd in the low word and a child PID above it
+        fd = (int)(ev[i].data.u64 & 0xffffffff);
+        if (fd == sigfd)
+            handle_signals();
+        else if (fd == inotifyfd)
+            clearhash();
+        else if (fd == govtimer)
+            govtick();
+        else {
+            for (j = 0; j < NPSI && psi[j].fd != fd; j++)
+                ;
+            if (j < NPSI)
+                govern(&psi[j]);
+            else
+                reap_pidfd(fd, (pid_t)(ev[i].data.u64 >> 32));
+        }
+    }
+
+    // Whatever finished may have made room for a pending job
+    if (jobs->pending)
+        admitjobs();
+}
+
+/*
+ * handle_signals - Drain sigfd and run the handler for each signal
+ */
+void handle_signals(void)
+{
+    struct signalfd_siginfo si[MAXEVENTS];
+    ssize_t n;
+    int i;
+
+    while ((n = read(sigfd, si, sizeof(si))) > 0) {
+        for (i = 0; i < n / (ssize_t)sizeof(si[0]); i++) {
+            switch (si[i].ssi_signo) {
+            case SIGCHLD:
+                sigchld_handler(SIGCHLD);
+                break;
+            case SIGINT:
+                sigint_handler(SIGINT);
+                break;
+            case SIGTSTP:
+                sigtstp_handler(SIGTSTP);
+                break;
+            case SIGQUIT:
+                sigquit_handler(SIGQUIT);
+                break;
+            }
+        }
+    }
+    if (n < 0 && errno != EAGAIN && errno != EINTR)
+        unix_error("signalfd read error");
+}
+
+/*
+ * launch - Open the redirections of one pipeline stage, which win over
+ *    the pipe ends infd and outfd, and spawn it in process group pgid.
+ *    Returns the child PID, or -1 if the stage couldn't be started.
+ */
+pid_t launch(struct stage_t *stage, pid_t pgid, int infd, int outfd)
+{
+    int filein = -1, fileout = -1;
+    pid_t pid = -1;
+    long long start;
+
+    if (stage->infile && (filein = open(stage->infile, O_RDONLY | O_CLOEXEC)) < 0){
+        perror("Could not open file for reading");
+        return -1;
+    }
+    if (stage->outfile && (fileout = open(stage->outfile,
+                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0){
+        perror("Could not open file for writing");
+    } else {
+        TRACE("spawn", 'B', 0, 0);
+        start = nsnow();
+        pid = spawn(stage->argv, pgid, filein >= 0 ? filein : infd,
+                fileout >= 0 ? fileout : outfd);
+        if (pid > 0)
+            latrecord(LAT_SPAWN, nsnow() - start);
+        TRACE("spawn", 'E', 0, pid);
+    }
+
+    if (filein >= 0)
+        close(filein);
+    if (fileout >= 0)
+        close(fileout);
+    return pid;
+}
+
+/*
+ * spawn - Start argv in process group pgid (0 for a new group) with its
+ *    stdin and stdout dup'd from infd and outfd (-1 to inherit them).
+ *    posix_spawn shares the shell's page tables until the exec, so the
+ *    launch cost doesn't grow with the shell's RSS; plain fork is only
+ *    used if asked for (-f), if posix_spawn isn't implemented, or if
+ *    the child has to wait for releasestages before it execs.
+ *    Returns the child PID, or -1 if argv[0] couldn't be executed.
+ */
+pid_t spawn(char **argv, pid_t pgid, int infd, int outfd)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    char *path;
+    pid_t pid;
+    int err;
+
+    if (!(path = findcmd(argv[0]))) {
+        printf("%s: command not found.\n", argv[0]);
+        return -1;
+    }
+
+    if (!usefork && holdfds[0] < 0) {
+        posix_spawn_file_actions_init(&actions);
+        if (infd >= 0)
+            posix_spawn_file_actions_adddup2(&actions, infd, STDIN_FILENO);
+        if (outfd >= 0)
+            posix_spawn_file_actions_adddup2(&actions, outfd, STDOUT_FILENO);
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+        posix_spawnattr_setpgroup(&attr, pgid);
+        posix_spawnattr_setsigmask(&attr, &child_mask);
+
+        err = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+        if (err == ENOENT && path != argv[0]) {
+            // The hashed location went away; search PATH once more
+            clearhash();
+            if ((path = findcmd(argv[0])))
+                err = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+        }
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&actions);
+
+        if (err == 0)
+            return pid;
+        if (err == EAGAIN || err == ENOMEM) {
+            errno = err;
+            unix_error("posix_spawn");
+        }
+        if (err != ENOSYS) {
+            printf("%s: command not found.\n", argv[0]);
+            return -1;
+        }
+        usefork = 1;
+    }
+
+    pid = fork();
+    if (pid < 0)
+        unix_error("fork");
+    if (pid == 0){
+        // Give the child the signal mask the shell started with
+        sigprocmask(SIG_SETMASK, &child_mask, NULL);
+        setpgid(0, pgid);
+        // Redirect standard input and output, if appropriate
+        if (infd >= 0)
+            dup2(infd, STDIN_FILENO);
+        if (outfd >= 0)
+            dup2(outfd, STDOUT_FILENO);
+        waithold();
+        if (execve(path, argv, environ) < 0){
+            printf("%s: command not found.\n", argv[0]);
+            exit(0);
+        }
+    }
+    // Set the group from here too, so it exists before we signal it
+    setpgid(pid, pgid ? pgid : pid);
+    return pid;
+}
+
+/*
+ * holdstages - Make the stages started from now on wait, just before
+ *    they exec, until releasestages. Out of fds, they don't wait.
+ */
+void holdstages(void)
+{
+    if (pipe2(holdfds, O_CLOEXEC) < 0)
+        holdfds[0] = holdfds[1] = -1;
+}
+
+/*
+ * waithold - In a child, wait for releasestages if it was started held.
+ *    Every child closes its copy of the write end, so the read sees EOF
+ *    once the shell closes its own.
+ */
+void waithold(void)
+{
+    char c;
+
+    if (holdfds[0] < 0)
+        return;
+    close(holdfds[1]);
+    while (read(holdfds[0], &c, 1) < 0 && errno == EINTR)
+        ;
+    close(holdfds[0]);
+}
+
+/* releasestages - Let the held stages go on, if there are any */
+void releasestages(void)
+{
+    if (holdfds[0] < 0)
+        return;
+    close(holdfds[0]);
+    close(holdfds[1]);
+    holdfds[0] = holdfds[1] = -1;
+}
+
+/*
+ * trackchild - Open a pidfd for a freshly forked child and watch it for
+ *    exit in evfd. Returns the pidfd, or -1 if the child has to be reaped
+ *    from SIGCHLD instead.
+ */
+int trackchild(pid_t pid)
+{
+    struct epoll_event ev;
+    int pidfd;
+
+    if (!usepidfd)
+        return -1;
+    if ((pidfd = syscall(SYS_pidfd_open, pid, 0)) < 0) {
+        untracked++;
+        return -1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.u64 = ((unsigned long long)pid << 32) | (unsigned)pidfd;
+    if (epoll_ctl(evfd, EPOLL_CTL_ADD, pidfd, &ev) < 0) {
+        close(pidfd);
+        untracked++;
+        return -1;
+    }
+    return pidfd;
+}
+
+/*
+ * reap_pidfd - Reap the exited child pid behind pidfd and update its job
+ */
+void reap_pidfd(int pidfd, pid_t pid)
+{
+    struct job_t *job;
+    struct proc_t *proc;
+    struct rusage ru;
+    siginfo_t si;
+
+    si.si_pid = 0;
+    if (waitru(P_PIDFD, pidfd, &si, WEXITED | WNOHANG, &ru) < 0) {
+        // SIGCHLD got to it first while someone was untracked
+        if (errno != ECHILD)
+            unix_error("waitid error");
+    } else if (si.si_pid == 0) {
+        return;
+    }
+
+    // A child forked since may still share the pidfd, so closing it
+    // alone wouldn't drop it from evfd
+    epoll_ctl(evfd, EPOLL_CTL_DEL, pidfd, NULL);
+    close(pidfd);
+    if ((job = getjobpid(jobs, pid)) && (proc = getproc(job, pid)))
+        proc->pidfd = -1;
+    if (si.si_pid != 0)
+        update_job(pid, wstatus(&si), &ru);
+}
+
+/*
+ * waitru - waitid that also fills in the resources the child used. The
+ *    system call has always taken the rusage; the libc wrapper just
+ *    doesn't pass it along.
+ */
+int waitru(idtype_t idtype, id_t id, siginfo_t *si, int options, struct rusage *ru)
+{
+    return syscall(SYS_waitid, idtype, id, si, options, ru);
+}
+
+/*
+ * wstatus - Encode a waitid result as a waitpid-style status
+ */
+int wstatus(const siginfo_t *si)
+{
+    switch (si->si_code) {
+    case CLD_EXITED:
+        return W_EXITCODE(si->si_status, 0);
+    case CLD_KILLED:
+    case CLD_DUMPED:
+        return W_EXITCODE(0, si->si_status);
+    case CLD_STOPPED:
+    case CLD_TRAPPED:
+        return W_STOPCODE(si->si_status);
+    default:
+        return 0xffff; /* continued */
+    }
+}
+
+/*
+ * signaljob - Send sig to the job's process group. Going through the
+ *    pidfd of a live stage means the signal can't land on a recycled
+ *    PID; kill() is the fallback.
+ */
+int signaljob(struct job_t *job, int sig)
+{
+    int i;
+
+    // Anything meant to end a parallel job ends its queue too. One with
+    // nothing running has no process group left to signal
+    if (job->queue && (sig == SIGINT || sig == SIGTERM || sig == SIGKILL ||
+                       sig == SIGHUP || sig == SIGQUIT))
+        job->queue->cancelled = 1;
+    if (job->nlive == 0)
+        return 0;
+
+    for (i = 0; i < job->nprocs; i++)
+        if (job->procs[i].pid && job->procs[i].pidfd >= 0)
+            return syscall(SYS_pidfd_send_signal, job->procs[i].pidfd, sig,
+                    NULL, PIDFD_SIGNAL_PROCESS_GROUP) == 0 ? 0 : kill(-job->pid, sig);
+    return kill(-job->pid, sig);
+}
+
+/*
+ * readline - Copy the next input line (with its newline) into *linep,
+ *    growing it (and *capp) to fit, and handling job events while
+ *    waiting for input. Lines ending in a backslash go on into the
+ *    next one. Returns 0 at end of file.
  */
-handler_t *Signal(int signum, handler_t *handler) 
+int readline(char **linep, size_t *capp)
 {
-    struct sigaction action, old_action;
+    struct epoll_event ev[2];
+    char *nl;
+    int i, ready;
+    ssize_t n;
+    size_t len, from = 0;
+
+    while (!(nl = memchr(inbuf + from, '\n', inlen - from)) ||
+           continued(inbuf, nl - inbuf + 1)) {
+        if (nl) {
+            from = nl - inbuf + 1;
+            continue;
+        }
+        if (inlen == incap) {
+            incap = incap ? 2 * incap : MAXLINE;
+            if (!(inbuf = realloc(inbuf, incap)))
+                unix_error("realloc error");
+        }
+
+        // Wait until stdin is readable, running the job events meanwhile
+        if ((ready = !stdin_pollable)){
+            dispatch_events(0);
+            drainnotes();
+        }
+        while (!ready) {
+            if ((n = epoll_wait(replfd, ev, 2, -1)) < 0) {
+                if (errno == EINTR)
+                    continue;
+                unix_error("epoll_wait error");
+            }
+            for (i = 0; i < n; i++) {
+                if (ev[i].data.fd == evfd){
+                    // Nothing else is going on, so say what happened now
+                    dispatch_events(0);
+                    drainnotes();
+                } else
+                    ready = 1;
+            }
+        }
+
+        if ((n = read(STDIN_FILENO, inbuf + inlen, incap - inlen)) < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            app_error("read error");
+        }
+        if (n == 0) {
+            // End of file: hand back a final unterminated line, if any
+            if (inlen == 0)
+                return 0;
+            inbuf[inlen++] = '\n';
+            continue;
+        }
+        inlen += n;
+    }
+
+    len = nl - inbuf + 1;
+    if (len + 1 > *capp) {
+        *capp = len + 1 > MAXLINE ? len + 1 : MAXLINE;
+        if (!(*linep = realloc(*linep, *capp)))
+            unix_error("realloc error");
+    }
+    memcpy(*linep, inbuf, len);
+    (*linep)[len] = '\0';
+    inlen -= len;
+    memmove(inbuf, inbuf + len, inlen);
+    return 1;
+}
 
-    action.sa_handler = handler;  
-    sigemptyset(&action.sa_mask); /* block sigs of type being handled */
-    action.sa_flags = SA_RESTART; /* restart syscalls if possible */
+/*
+ * continued - Return true if the len bytes at line, which end in a
+ *    newline, end in a backslash outside quotes: the line goes on into
+ *    the next one, and parseline takes the backslash and newline out
+ */
+int continued(const char *line, size_t len) {
+    char quote = 0;
+    size_t i;
 
-    if (sigaction(signum, &action, &old_action) < 0)
-	unix_error("Signal error");
-    return (old_action.sa_handler);
+    for (i = 0; i + 1 < len; i++) {
+        if (quote == '\'')
+            quote = line[i] == '\'' ? 0 : quote;
+        else if (line[i] == '\\' && i + 2 == len)
+            return !quote;
+        else if (line[i] == '\\')
+            i++;
+        else if (line[i] == '"')
+            quote = quote ? 0 : '"';
+        else if (line[i] == '\'')
+            quote = '\'';
+    }
+    return 0;
 }
 
 /*
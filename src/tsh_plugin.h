@@ -0,0 +1,62 @@
+/*
+ * tsh_plugin.h - The interface between tsh and builtins loaded with
+ *    enable -f lib.so [name...]
+ *
+ * A plugin is a shared object that defines tsh_plugin_init. The shell
+ * calls it once when the object is loaded, and it returns a table of
+ * the commands it provides:
+ *
+ *     #include "tsh_plugin.h"
+ *
+ *     static int hello(int argc, char **argv, int infd, int outfd) {
+ *         dprintf(outfd, "hello from %s\n", argv[0]);
+ *         return 0;
+ *     }
+ *
+ *     static const struct tsh_builtin builtins[] = {
+ *         {"hello", hello},
+ *         {NULL, NULL}
+ *     };
+ *
+ *     const struct tsh_builtin *tsh_plugin_init(int abi) {
+ *         return abi == TSH_PLUGIN_ABI ? builtins : NULL;
+ *     }
+ *
+ * Build it with cc -shared -fPIC -o hello.so hello.c.
+ */
+#ifndef TSH_PLUGIN_H
+#define TSH_PLUGIN_H
+
+/* Bumped whenever anything below changes incompatibly */
+#define TSH_PLUGIN_ABI 1
+
+/* What the shell looks up in a plugin */
+#define TSH_PLUGIN_INIT "tsh_plugin_init"
+
+/*
+ * tsh_builtin_fn - Run a builtin. argv holds its argc arguments and is
+ *    NULL terminated; argv[0] is the name it was run as. infd and outfd
+ *    are its stdin and stdout, with any pipes and redirections already
+ *    applied; they are also dup'd onto fds 0 and 1, so stdio works.
+ *    Returns its exit status.
+ *
+ *    It runs in the shell's own process (or a fork of it, when it's a
+ *    stage of a pipeline), so it must return rather than exit, leave the
+ *    fds it was given open, and free what it allocates.
+ */
+typedef int (*tsh_builtin_fn)(int argc, char **argv, int infd, int outfd);
+
+struct tsh_builtin {        /* A command a plugin provides */
+    const char *name;       /* what it's run as, NULL to end the table */
+    tsh_builtin_fn fn;      /* runs it */
+};
+
+/*
+ * tsh_plugin_init_fn - The type of tsh_plugin_init. abi is the
+ *    TSH_PLUGIN_ABI the shell was built with. Returns the plugin's table
+ *    of commands, which must stay valid while it is loaded, or NULL if
+ *    it can't work with that ABI.
+ */
+typedef const struct tsh_builtin *(*tsh_plugin_init_fn)(int abi);
+
+#endif /* TSH_PLUGIN_H */
@@ -0,0 +1,73 @@
+/*
+ * tsh_shm.h - The layout of the job table tsh -S publishes in
+ *    /dev/shm/tsh-<pid>
+ *
+ * The file is a struct tsh_shm followed by nslots struct tsh_shm_job,
+ * where slot i holds job [i] (slot 0 is never used). Only the shell
+ * writes it. It brackets every change with seq: odd while it's writing,
+ * even and one higher than before once it's done. A reader takes a
+ * snapshot without any syscall or lock by copying what it wants between
+ * two reads of seq, and keeps the copy if seq was even and the same both
+ * times:
+ *
+ *     do {
+ *         while ((seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE)) & 1)
+ *             ;
+ *         memcpy(&copy, shm, ...);
+ *         __atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *     } while (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) != seq);
+ *
+ * The file grows when there are more jobs than slots. A reader whose
+ * mapping is smaller than size has to map it again; it has seen a
+ * consistent table if it copied no further than its own mapping.
+ * tshmon.c is a reader.
+ *
+ * magic and version stay where they are for good. Fields are only
+ * added at the end of either struct, so readers use hdrsize and jobsize
+ * rather than sizeof; anything else bumps version.
+ */
+#ifndef TSH_SHM_H
+#define TSH_SHM_H
+
+#include <stdint.h>
+
+#define TSH_SHM_MAGIC   "tshjobs"     /* first bytes of the file, NUL included */
+#define TSH_SHM_VERSION 1             /* bumped whenever the layout changes incompatibly */
+#define TSH_SHM_PATH    "/dev/shm/tsh-%d" /* where the shell with that PID publishes */
+#define TSH_SHM_CMDLEN  256           /* bytes of a command line kept, NUL included */
+
+struct tsh_shm {            /* The start of the file */
+    char magic[8];          /* TSH_SHM_MAGIC */
+    uint32_t version;       /* TSH_SHM_VERSION */
+    uint32_t hdrsize;       /* where the slots start */
+    uint64_t seq;           /* the seqlock; odd while the shell is writing */
+    uint64_t size;          /* bytes in the file */
+    uint32_t jobsize;       /* bytes per slot */
+    uint32_t nslots;        /* slots, job [0] included */
+    int32_t pid;            /* the shell's PID */
+    int32_t njobs;          /* jobs on the list */
+    int32_t maxjid;         /* largest JID in use, 0 if none */
+    int32_t fgjid;          /* the FG job's JID, or 0 */
+    int32_t nbg;            /* jobs in the BG state */
+    int32_t pad;
+    uint64_t started;       /* jobs added to the list so far */
+    uint64_t finished;      /* and taken off it */
+};
+
+struct tsh_shm_job {        /* A slot */
+    int32_t jid;            /* the job's ID, 0 if the slot is free */
+    int32_t pid;            /* its PID (process group ID), 0 if it's pending */
+    int32_t state;          /* 1 FG, 2 BG, 3 ST or 4 PD */
+    int32_t nprocs;         /* its pipeline stages */
+    int32_t nlive;          /* stages that haven't been reaped yet */
+    int32_t status;         /* wait status of its last stage, once known */
+    int64_t start;          /* CLOCK_MONOTONIC ns when it was started */
+    int64_t utime;          /* user CPU ns its reaped stages used */
+    int64_t stime;          /* and system CPU ns */
+    int64_t maxrss;         /* the most KB any of them had resident */
+    uint32_t cmdlen;        /* length of the command line, which may be more than fits */
+    uint32_t pad;
+    char cmdline[TSH_SHM_CMDLEN]; /* the command line, cut to fit and NUL terminated */
+};
+
+#endif /* TSH_SHM_H */
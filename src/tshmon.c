@@ -0,0 +1,325 @@
+/*
+ * tshmon.c - Read the job table a tsh -S publishes
+ *
+ * usage: tshmon <pid>
+ *        Prints the job table of the shell with that PID.
+ *
+ *        tshmon -H <tsh> [n]
+ *        Tests the table: runs <tsh> -S on n rounds (100 by default) of
+ *        jobs starting, queueing and finishing, and takes snapshots as
+ *        fast as it can meanwhile, checking each one holds together.
+ *        Exits nonzero if any doesn't.
+ *
+ * Taking a snapshot makes no syscalls unless the table has grown.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tsh_shm.h"
+
+struct table_t {            /* A published job table */
+    int fd;                 /* its file */
+    struct tsh_shm *shm;    /* mapped */
+    size_t size;            /* bytes mapped */
+};
+
+struct snap_t {             /* A consistent copy of one */
+    struct tsh_shm hdr;     /* its header */
+    struct tsh_shm_job *slots; /* its slots */
+    int nslots;             /* slots copied */
+    int cap;                /* room in slots */
+    unsigned long retries;  /* copies thrown away since the last snapshot */
+};
+
+int opentable(struct table_t *t, pid_t pid);
+int maptable(struct table_t *t);
+int snapshot(struct table_t *t, struct snap_t *s, int all);
+int checksnap(const struct snap_t *s, char *why, size_t size);
+void printsnap(const struct snap_t *s);
+int hammer(const char *tsh, int rounds);
+
+int main(int argc, char **argv)
+{
+    struct table_t t;
+    struct snap_t s;
+
+    if (argc >= 3 && !strcmp(argv[1], "-H"))
+        return hammer(argv[2], argc > 3 ? atoi(argv[3]) : 100);
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <pid> | -H <tsh> [rounds]\n", argv[0]);
+        exit(2);
+    }
+    if (opentable(&t, atoi(argv[1])) < 0) {
+        fprintf(stderr, "%s: " TSH_SHM_PATH ": %s\n", argv[0], atoi(argv[1]),
+                errno ? strerror(errno) : "not a tsh job table");
+        exit(1);
+    }
+    memset(&s, 0, sizeof(s));
+    snapshot(&t, &s, 0);
+    printsnap(&s);
+    exit(0);
+}
+
+/*
+ * opentable - Open and map the table of the shell with PID pid. Returns
+ *    0, or -1 with errno set (0 if it isn't a table this can read)
+ */
+int opentable(struct table_t *t, pid_t pid)
+{
+    char path[64];
+
+    snprintf(path, sizeof(path), TSH_SHM_PATH, pid);
+    if ((t->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    t->shm = NULL;
+    t->size = 0;
+    if (maptable(t) < 0)
+        return -1;
+
+    // The shell writes the magic last, so one that's there is complete
+    errno = 0;
+    if (memcmp(t->shm->magic, TSH_SHM_MAGIC, sizeof(t->shm->magic))
+            || __atomic_load_n(&t->shm->version, __ATOMIC_ACQUIRE) != TSH_SHM_VERSION)
+        return -1;
+    return 0;
+}
+
+/* maptable - Map all of t's file, again if it has grown. Returns 0 or -1 */
+int maptable(struct table_t *t)
+{
+    struct stat st;
+    void *p;
+
+    if (fstat(t->fd, &st) < 0)
+        return -1;
+    if ((size_t)st.st_size < sizeof(struct tsh_shm)) {
+        errno = 0;
+        return -1;
+    }
+    if (t->shm)
+        munmap(t->shm, t->size);
+    if ((p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, t->fd, 0)) == MAP_FAILED)
+        return -1;
+    t->shm = p;
+    t->size = st.st_size;
+    return 0;
+}
+
+/*
+ * snapshot - Copy t into s: the slots up to maxjid, or all of them if
+ *    all is set. Returns 0, or -1 if the table can't be mapped again
+ */
+int snapshot(struct table_t *t, struct snap_t *s, int all)
+{
+    struct tsh_shm *shm = t->shm;
+    const char *base;
+    uint64_t seq, size;
+    int i, n, spins = 0;
+
+    s->retries = 0;
+    for (;; s->retries++) {
+        // The shell is writing; on a busy CPU it may need the CPU to finish
+        if ((seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE)) & 1) {
+            if (++spins % 64 == 0)
+                sched_yield();
+            continue;
+        }
+        memcpy(&s->hdr, shm, sizeof(s->hdr));
+
+        // Only what's mapped can be copied, but the table may be bigger
+        size = s->hdr.size;
+        if (size > t->size) {
+            if (maptable(t) < 0)
+                return -1;
+            shm = t->shm;
+            continue;
+        }
+        n = all ? (int)s->hdr.nslots : s->hdr.maxjid + 1;
+        if (n < 0 || (size_t)n > (t->size - s->hdr.hdrsize) / s->hdr.jobsize)
+            n = (t->size - s->hdr.hdrsize) / s->hdr.jobsize;
+        if (n > s->cap) {
+            s->cap = n;
+            if (!(s->slots = realloc(s->slots, n * sizeof(*s->slots)))) {
+                perror("realloc");
+                exit(2);
+            }
+        }
+        base = (const char *)shm + s->hdr.hdrsize;
+        for (i = 0; i < n; i++)
+            memcpy(&s->slots[i], base + i * s->hdr.jobsize,
+                   s->hdr.jobsize < sizeof(*s->slots) ? s->hdr.jobsize : sizeof(*s->slots));
+        s->nslots = n;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq)
+            return 0;
+    }
+}
+
+/*
+ * checksnap - Check that s is a table the shell could have written in
+ *    one go. Returns 1 if so, or 0 with what's wrong in why
+ */
+int checksnap(const struct snap_t *s, char *why, size_t size)
+{
+    const struct tsh_shm *h = &s->hdr;
+    const struct tsh_shm_job *j;
+    int i, used = 0, nbg = 0, last = 0;
+    size_t len;
+
+#define FAIL(...) do { snprintf(why, size, __VA_ARGS__); return 0; } while (0)
+    if (h->seq & 1)
+        FAIL("odd seq %llu", (unsigned long long)h->seq);
+    if (h->started - h->finished != (uint64_t)h->njobs)
+        FAIL("started %llu - finished %llu != %d jobs", (unsigned long long)h->started,
+             (unsigned long long)h->finished, h->njobs);
+    for (i = 0; i < s->nslots; i++) {
+        j = &s->slots[i];
+        if (!j->jid)
+            continue;
+        if (j->jid != i)
+            FAIL("slot %d holds job %d", i, j->jid);
+        if (j->state < 1 || j->state > 4)
+            FAIL("job %d in state %d", i, j->state);
+        if (j->nlive < 0 || j->nlive > j->nprocs)
+            FAIL("job %d has %d of %d stages live", i, j->nlive, j->nprocs);
+        if (j->state == 4 && j->nprocs)
+            FAIL("pending job %d has %d stages", i, j->nprocs);
+        if (!memchr(j->cmdline, '\0', sizeof(j->cmdline)))
+            FAIL("job %d has no NUL in its command line", i);
+        len = strlen(j->cmdline);
+        if (len != (j->cmdlen < sizeof(j->cmdline) ? j->cmdlen : sizeof(j->cmdline) - 1))
+            FAIL("job %d has a %zu byte command line, not %u", i, len, j->cmdlen);
+        used++;
+        last = i;
+        nbg += j->state == 2;
+    }
+    if (used != h->njobs)
+        FAIL("%d slots used for %d jobs", used, h->njobs);
+    if (last != h->maxjid)
+        FAIL("last job %d, maxjid %d", last, h->maxjid);
+    if (nbg != h->nbg)
+        FAIL("%d BG jobs, nbg %d", nbg, h->nbg);
+    if (h->fgjid && (h->fgjid >= s->nslots || s->slots[h->fgjid].state != 1))
+        FAIL("FG job %d isn't in the FG state", h->fgjid);
+#undef FAIL
+    return 1;
+}
+
+/* printsnap - Print s the way jobs would, after a summary */
+void printsnap(const struct snap_t *s)
+{
+    static const char *states[] = {"Undefined", "Foreground", "Running", "Stopped", "Pending"};
+    const struct tsh_shm_job *j;
+    int i;
+
+    printf("tsh %d: %d jobs (%d BG, FG [%d]), %llu started, %llu finished, seq %llu\n",
+           s->hdr.pid, s->hdr.njobs, s->hdr.nbg, s->hdr.fgjid,
+           (unsigned long long)s->hdr.started, (unsigned long long)s->hdr.finished,
+           (unsigned long long)s->hdr.seq);
+    for (i = 1; i < s->nslots; i++) {
+        if (!(j = &s->slots[i])->jid)
+            continue;
+        printf("[%d] (%d) %s %d/%d live, user %.3fs sys %.3fs maxrss %lldK %s%s\n",
+               j->jid, j->pid, j->state >= 0 && j->state <= 4 ? states[j->state] : "?", j->nlive, j->nprocs,
+               j->utime / 1e9, j->stime / 1e9, (long long)j->maxrss, j->cmdline,
+               j->cmdlen >= sizeof(j->cmdline) ? "..." : "");
+    }
+}
+
+/*
+ * hammer - Run tsh -S on rounds of churning jobs and check snapshots of
+ *    its table until it exits. Returns the exit status for main
+ */
+int hammer(const char *tsh, int rounds)
+{
+    struct table_t t;
+    struct snap_t s;
+    struct timespec ts = {0, 1000000};
+    unsigned long nsnaps = 0, nretries = 0, nchanges = 0, nbad = 0;
+    uint64_t lastseq = 0;
+    char *script, *p, why[256];
+    int i, k, status, maxjobs = 0;
+    pid_t pid;
+
+    // Lines of different lengths, so a torn copy of a reused slot shows.
+    // The shell runs /bin/true itself, so these are sleeps
+    if (!(p = script = malloc(rounds * 16 * 96 + 64))) {
+        perror("malloc");
+        return 2;
+    }
+    p += sprintf(p, "bglimit 6\n");
+    for (i = 0; i < rounds; i++) {
+        for (k = 0; k < 15; k++) {
+            p += sprintf(p, "/bin/sleep 0.00%d", k % 3);
+            p += sprintf(p, "%.*s", (i + k) % 9 * 4, " 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0");
+            p += sprintf(p, k % 5 == 4 ? " | /bin/cat &\n" : " &\n");
+        }
+        p += sprintf(p, "/bin/sleep 0.00%d\n", i % 10);
+    }
+
+    if ((pid = fork()) < 0) {
+        perror("fork");
+        return 2;
+    }
+    if (pid == 0) {
+        int fd = open("/dev/null", O_WRONLY);
+        dup2(fd, STDOUT_FILENO);
+        execl(tsh, tsh, "-S", "-c", script, (char *)NULL);
+        perror(tsh);
+        _exit(127);
+    }
+    free(script);
+
+    // The table shows up once the shell has started
+    for (i = 0; opentable(&t, pid) < 0; i++) {
+        if (i == 5000 || waitpid(pid, &status, WNOHANG) == pid) {
+            fprintf(stderr, "tshmon: %s -S never published its job table\n", tsh);
+            return 1;
+        }
+        nanosleep(&ts, NULL);
+    }
+
+    memset(&s, 0, sizeof(s));
+    for (i = 0; ; i++) {
+        if (snapshot(&t, &s, 1) < 0) {
+            perror("tshmon: mmap");
+            return 2;
+        }
+        nsnaps++;
+        nretries += s.retries;
+        if (!checksnap(&s, why, sizeof(why))) {
+            if (nbad++ < 10)
+                fprintf(stderr, "tshmon: bad snapshot at seq %llu: %s\n",
+                        (unsigned long long)s.hdr.seq, why);
+        } else if (s.hdr.seq < lastseq) {
+            if (nbad++ < 10)
+                fprintf(stderr, "tshmon: seq went back from %llu to %llu\n",
+                        (unsigned long long)lastseq, (unsigned long long)s.hdr.seq);
+        }
+        nchanges += s.hdr.seq != lastseq;
+        lastseq = s.hdr.seq;
+        if (s.hdr.njobs > maxjobs)
+            maxjobs = s.hdr.njobs;
+        if (i % 4096 == 0 && waitpid(pid, &status, WNOHANG) == pid)
+            break;
+    }
+
+    printf("%lu snapshots (%lu retried copies) saw %lu versions of the table: "
+           "%llu jobs, at most %d at once, %lu bad\n",
+           nsnaps, nretries, nchanges, (unsigned long long)s.hdr.started, maxjobs, nbad);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        fprintf(stderr, "tshmon: %s exited with status %#x\n", tsh, status);
+        return 1;
+    }
+    return nbad || !nsnaps || !s.hdr.started;
+}